@@ -1,25 +1,273 @@
-// Simple program that prints escape sequences from stdin
+// Simple program that prints the input chunks from stdin the way the terminal delivers
+// them: the bytes of each read(), when it arrived and how the escape sequences ended up
+// split between or packed into the reads. The session can be recorded into a file that
+// `noed -replay` can play back.
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include <termios.h>
 #include <unistd.h>
 
 #define return_defer(value) do { result = (value); goto defer; } while(0)
 
-int main(void)
+// Must be kept in sync with the reader in main.c
+#define INPUT_RECORD_MAGIC "NOEDINP1"
+
+typedef struct {
+    uint64_t time_ns; // Since the beginning of the recording
+    uint64_t size;    // Followed by that many bytes of the chunk
+} Input_Chunk;
+
+#define MAX_CHUNK_SIZE 4096
+
+typedef enum {
+    SEQ_GROUND = 0,
+    SEQ_ESC,
+    SEQ_CSI,
+    SEQ_SS3,
+} Seq_State;
+
+typedef struct {
+    Seq_State state;
+    uint64_t seq_start_ns; // When the first read of the unfinished sequence arrived
+    size_t seq_reads;      // How many reads the unfinished sequence is spread over
+
+    uint64_t prev_ns;
+    size_t chunks;
+    size_t bytes;
+    size_t keys;
+    size_t packed_chunks;  // Chunks with more than one key
+    size_t split_seqs;     // Sequences that came in several reads
+    uint64_t max_split_ns; // Longest time between the first and the last read of a split sequence
+    uint64_t *gaps;        // Times between the consecutive reads
+    size_t gaps_count;
+    size_t gaps_capacity;
+} Stats;
+
+static volatile sig_atomic_t quit = 0;
+
+void interrupt_signal(int signal)
+{
+    (void) signal;
+    quit = 1;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+}
+
+void stats_finish_seq(Stats *s, uint64_t time_ns)
+{
+    s->keys += 1;
+    if (s->seq_reads > 1) {
+        s->split_seqs += 1;
+        if (time_ns - s->seq_start_ns > s->max_split_ns) s->max_split_ns = time_ns - s->seq_start_ns;
+    }
+    s->state = SEQ_GROUND;
+    s->seq_reads = 0;
+}
+
+// Splits the chunk into keys the way the terminals encode them: single bytes, UTF-8
+// characters, ESC followed by a byte (Alt), CSI and SS3 sequences. Prints the chunk
+// with the notes about how the keys were delivered.
+void stats_add_chunk(Stats *s, uint64_t time_ns, const unsigned char *chunk, size_t size)
+{
+    uint64_t gap = s->chunks > 0 ? time_ns - s->prev_ns : 0;
+    if (s->chunks > 0) {
+        if (s->gaps_count >= s->gaps_capacity) {
+            s->gaps_capacity = s->gaps_capacity == 0 ? 1024 : s->gaps_capacity*2;
+            s->gaps = realloc(s->gaps, s->gaps_capacity*sizeof(*s->gaps));
+            assert(s->gaps != NULL && "Buy more RAM lol");
+        }
+        s->gaps[s->gaps_count++] = gap;
+    }
+    s->prev_ns = time_ns;
+    s->chunks += 1;
+    s->bytes += size;
+
+    size_t keys_before = s->keys;
+    // A lone ESC at the end of the previous read was the Escape key itself unless this
+    // read continues a sequence
+    if (s->state == SEQ_ESC && (size == 0 || (chunk[0] != '[' && chunk[0] != 'O'))) {
+        s->keys += 1;
+        s->state = SEQ_GROUND;
+        s->seq_reads = 0;
+        keys_before = s->keys;
+    }
+    bool continues = s->state != SEQ_GROUND;
+    if (continues) s->seq_reads += 1;
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char x = chunk[i];
+        switch (s->state) {
+        case SEQ_GROUND:
+            if (x == 0x1b) {
+                s->state = SEQ_ESC;
+                s->seq_start_ns = time_ns;
+                s->seq_reads = 1;
+            } else if ((x & 0xC0) != 0x80) {
+                // The continuation bytes of UTF-8 belong to the key of their leading byte
+                s->keys += 1;
+            }
+            break;
+        case SEQ_ESC:
+            if (x == '[') {
+                s->state = SEQ_CSI;
+            } else if (x == 'O') {
+                s->state = SEQ_SS3;
+            } else if (x == 0x1b) {
+                // The previous ESC was the Escape key itself
+                s->keys += 1;
+                s->seq_start_ns = time_ns;
+                s->seq_reads = 1;
+            } else {
+                stats_finish_seq(s, time_ns);
+            }
+            break;
+        case SEQ_CSI:
+            if (0x40 <= x && x <= 0x7E) stats_finish_seq(s, time_ns);
+            break;
+        case SEQ_SS3:
+            stats_finish_seq(s, time_ns);
+            break;
+        }
+    }
+    size_t keys = s->keys - keys_before;
+    if (keys > 1) s->packed_chunks += 1;
+
+    printf("%10.3fms +%9.3fms \"", time_ns/1e6, gap/1e6);
+    for (size_t i = 0; i < size; ++i) {
+        printf("\\x%02x", chunk[i]);
+    }
+    printf("\"");
+    if (continues) printf(" [continues the sequence]");
+    if (keys > 1) printf(" [%zu keys]", keys);
+    if (s->state == SEQ_ESC) {
+        printf(" [ESC or the beginning of a sequence]");
+    } else if (s->state != SEQ_GROUND) {
+        printf(" [unfinished sequence]");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void stats_report(Stats *s)
+{
+    // An ESC that nothing followed is the Escape key
+    if (s->state == SEQ_ESC) stats_finish_seq(s, s->prev_ns);
+
+    printf("Reads:           %zu\n", s->chunks);
+    printf("Bytes:           %zu\n", s->bytes);
+    printf("Keys:            %zu\n", s->keys);
+    printf("Packed reads:    %zu (more than one key in a read)\n", s->packed_chunks);
+    printf("Split sequences: %zu (longest %.3fms)\n", s->split_seqs, s->max_split_ns/1e6);
+    if (s->gaps_count > 0) {
+        qsort(s->gaps, s->gaps_count, sizeof(*s->gaps), compare_u64);
+        printf("Between reads:   min %.3fms, median %.3fms, p99 %.3fms, max %.3fms\n",
+               s->gaps[0]/1e6,
+               s->gaps[s->gaps_count/2]/1e6,
+               s->gaps[s->gaps_count*99/100]/1e6,
+               s->gaps[s->gaps_count - 1]/1e6);
+    }
+}
+
+bool analyze_recording(Stats *s, const char *file_path)
+{
+    bool result = true;
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return_defer(false);
+    }
+
+    char magic[sizeof(INPUT_RECORD_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, INPUT_RECORD_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not an input recording\n", file_path);
+        return_defer(false);
+    }
+
+    Input_Chunk chunk;
+    unsigned char buf[MAX_CHUNK_SIZE];
+    while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+        if (chunk.size > sizeof(buf) || fread(buf, chunk.size, 1, f) != 1) {
+            fprintf(stderr, "ERROR: %s is truncated\n", file_path);
+            return_defer(false);
+        }
+        stats_add_chunk(s, chunk.time_ns, buf, chunk.size);
+    }
+
+defer:
+    if (f) fclose(f);
+    return result;
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program);
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "    -o <file>    record the input into <file>\n");
+    fprintf(stderr, "    -i <file>    analyze the input recorded in <file> instead of the terminal\n");
+}
+
+int main(int argc, char **argv)
 {
     int result = 0;
     bool terminal_prepared = false;
+    const char *output_path = NULL;
+    const char *input_path = NULL;
+    FILE *output = NULL;
+    Stats stats = {0};
+    struct termios term;
+
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-i") == 0) && i + 1 < argc) {
+            if (argv[i][1] == 'o') output_path = argv[i + 1];
+            else input_path = argv[i + 1];
+            i += 1;
+        } else {
+            usage(argv[0]);
+            fprintf(stderr, "ERROR: unknown flag %s\n", argv[i]);
+            return_defer(1);
+        }
+    }
+
+    if (input_path != NULL) {
+        if (!analyze_recording(&stats, input_path)) return_defer(1);
+        stats_report(&stats);
+        return_defer(0);
+    }
+
     if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
         fprintf(stderr, "ERROR: Please run the program in the terminal!\n");
         return_defer(1);
     }
-    struct termios term;
+
+    if (output_path != NULL) {
+        output = fopen(output_path, "wb");
+        if (output == NULL) {
+            fprintf(stderr, "ERROR: could not open file %s: %s\n", output_path, strerror(errno));
+            return_defer(1);
+        }
+        fwrite(INPUT_RECORD_MAGIC, sizeof(INPUT_RECORD_MAGIC) - 1, 1, output);
+    }
+
     if (tcgetattr(STDIN_FILENO, &term) < 0) {
         fprintf(stderr, "ERROR: could not get the state of the terminal: %s\n", strerror(errno));
         return_defer(1);
@@ -34,32 +282,49 @@ int main(void)
 
     terminal_prepared = true;
 
-    bool quit = false;
+    // No SA_RESTART, so Ctrl+C gets us out of the read() with EINTR
+    struct sigaction act = {0};
+    act.sa_handler = interrupt_signal;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, NULL);
+
+    printf("Press the keys to see what the terminal sends. Ctrl+C to quit.\n");
+
+    uint64_t start = now_ns();
     while (!quit) {
-        // TODO: what's the biggest escape sequence?
-        // Or maybe we can try to read until we get EAGAIN?
-        // That way the max size of the sequence does not really matter
-        char seq[32];
-        memset(seq, 0, sizeof(seq));
-        int ret = read(STDIN_FILENO, seq, sizeof(seq));
+        // Way bigger than any escape sequence, so we can see when the keys are packed together
+        unsigned char chunk[MAX_CHUNK_SIZE];
+        int ret = read(STDIN_FILENO, chunk, sizeof(chunk));
+        uint64_t time = now_ns() - start;
         if (ret < 0) {
+            if (errno == EINTR) continue;
             fprintf(stderr, "ERROR: something went wrong during reading user input: %s\n", strerror(errno));
             return_defer(1);
         }
-        assert(ret < 32);
-        printf("\"");
-        for (int i = 0; i < ret; ++i) {
-            printf("\\x%02x", seq[i]);
+        if (ret == 0) break;
+        if (output != NULL) {
+            Input_Chunk header = { .time_ns = time, .size = ret };
+            fwrite(&header, sizeof(header), 1, output);
+            fwrite(chunk, ret, 1, output);
         }
-        printf("\"\n");
+        stats_add_chunk(&stats, time, chunk, ret);
     }
 
+    printf("\n");
+    stats_report(&stats);
+
 defer:
     if (terminal_prepared) {
-        printf("\033[2J");
         term.c_lflag |= ECHO;
         term.c_lflag |= ICANON;
         tcsetattr(STDIN_FILENO, 0, &term);
     }
+    if (output != NULL) {
+        if (fclose(output) != 0) {
+            fprintf(stderr, "ERROR: could not write file %s: %s\n", output_path, strerror(errno));
+            result = 1;
+        }
+    }
+    free(stats.gaps);
     return result;
 }
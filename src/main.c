@@ -1,25 +1,48 @@
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #define MAX_ESC_SEQ_LEN 32
+#define RESIZE_DEBOUNCE_NS (30*1000*1000)
+// The background jobs start from a copy of the buffer. For the big buffers the copy
+// is only made when the edits stop for that long, not on every key press.
+#define BACKGROUND_DEBOUNCE_NS (300*1000*1000)
+#define BACKGROUND_DEBOUNCE_SIZE (1024*1024)
+#define DEFAULT_ESC_TIMEOUT_MS 25
+#define INPUT_CAPACITY 4096
 
 // Escape Sequences
 #define ES_ESCAPE "\x1b"
 #define ES_BACKSPACE "\x7f"
 #define ES_DELETE "\x1b\x5b\x33\x7e"
+#define ES_CTRL_N "\x0e"
+#define ES_CTRL_P "\x10"
+#define ES_CTRL_T "\x14"
+#define ES_CTRL_RIGHT_BRACKET "\x1d"
 
 #define return_defer(value) do { result = (value); goto defer; } while(0)
 #define UNUSED(x) (void)(x)
@@ -41,6 +64,10 @@
 typedef struct {
     size_t begin;
     size_t end;
+    // Range of the tabs of this line in Editor.tabs. Empty range means that the line
+    // has no tabs and its visual columns are the same as its byte columns.
+    size_t tabs_begin;
+    size_t tabs_end;
 } Line;
 
 typedef struct {
@@ -55,6 +82,53 @@ typedef struct {
     size_t capacity;
 } Data;
 
+typedef struct {
+    size_t offset; // Position of the tab character in Editor.data
+    size_t col;    // Visual column right after the tab is expanded
+} Tab;
+
+typedef struct {
+    Tab *items;
+    size_t count;
+    size_t capacity;
+} Tabs;
+
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} Rows;
+
+typedef struct {
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} Offsets;
+
+typedef struct {
+    uint64_t *items;
+    size_t count;
+    size_t capacity;
+} Hashes;
+
+// Run of the lines that are the same on both sides
+typedef struct {
+    size_t a;
+    size_t b;
+    size_t count;
+} Diff_Match;
+
+typedef struct {
+    Diff_Match *items;
+    size_t count;
+    size_t capacity;
+} Diff_Matches;
+
+#define DEFAULT_TAB_WIDTH 8
+#define DEFAULT_TIME_FORMAT "%Y-%m-%d %H:%M:%S"
+#define MAX_TIMESTAMP_LEN 128
+#define TAGS_FILE_PATH "tags"
+
 #define ITEMS_INIT_CAPACITY (10*1024)
 
 #define da_append(da, item) do {                                                       \
@@ -74,6 +148,321 @@ typedef struct {
    }                                                                            \
 } while(0)
 
+#define da_append_many(da, new_items, new_items_count) do {                                    \
+    if ((da)->count + (new_items_count) > (da)->capacity) {                                    \
+        if ((da)->capacity == 0) (da)->capacity = ITEMS_INIT_CAPACITY;                         \
+        while ((da)->count + (new_items_count) > (da)->capacity) (da)->capacity *= 2;          \
+        (da)->items = realloc((da)->items, (da)->capacity*sizeof(*(da)->items));               \
+        ASSERT((da)->items != NULL, "Buy more RAM lol");                                       \
+    }                                                                                          \
+    memcpy((da)->items + (da)->count, (new_items), (new_items_count)*sizeof(*(da)->items));   \
+    (da)->count += (new_items_count);                                                          \
+} while (0)
+
+void data_append_cstr(Data *data, const char *cstr)
+{
+    size_t n = strlen(cstr);
+    da_append_many(data, cstr, n);
+}
+
+void data_vappendf(Data *data, const char *fmt, va_list args)
+{
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int n = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
+    ASSERT(n >= 0, "Invalid format string: %s", fmt);
+
+    // vsnprintf() always wants to put the null terminator
+    da_reserve(data, data->count + n + 1);
+    vsnprintf(data->items + data->count, n + 1, fmt, args);
+    data->count += n;
+}
+
+void data_appendf(Data *data, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    data_vappendf(data, fmt, args);
+    va_end(args);
+}
+
+#define MAX_WORKERS 16
+
+typedef void (*Parallel_Job)(void *ctx, size_t worker, size_t begin, size_t end);
+
+typedef struct {
+    Parallel_Job job;
+    void *ctx;
+    size_t worker;
+    size_t begin;
+    size_t end;
+} Parallel_Chunk;
+
+void *parallel_chunk_run(void *arg)
+{
+    Parallel_Chunk *chunk = arg;
+    chunk->job(chunk->ctx, chunk->worker, chunk->begin, chunk->end);
+    return NULL;
+}
+
+size_t parallel_workers_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    return n;
+}
+
+// Processes the range [0, count) by splitting it into contiguous chunks, one per
+// worker thread, and waits for all of them to finish. Chunks are ordered, so the
+// worker with the smaller index always gets the smaller items. Ranges smaller than
+// 2*min_chunk are processed on the calling thread. Returns the amount of workers
+// that were used.
+size_t parallel_for(size_t count, size_t min_chunk, void *ctx, Parallel_Job job)
+{
+    size_t workers = parallel_workers_count();
+    if (workers > count/min_chunk) workers = count/min_chunk;
+    if (workers <= 1) {
+        job(ctx, 0, 0, count);
+        return 1;
+    }
+
+    Parallel_Chunk chunks[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    size_t spawned = 0;
+    for (size_t i = 0; i < workers; ++i) {
+        chunks[i] = (Parallel_Chunk) {
+            .job = job,
+            .ctx = ctx,
+            .worker = i,
+            .begin = count*i/workers,
+            .end = count*(i + 1)/workers,
+        };
+    }
+    // The calling thread takes the first chunk itself
+    for (size_t i = 1; i < workers; ++i) {
+        if (pthread_create(&threads[i], NULL, parallel_chunk_run, &chunks[i]) != 0) break;
+        spawned += 1;
+    }
+    parallel_chunk_run(&chunks[0]);
+    for (size_t i = 1; i <= spawned; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    // If we failed to spawn some of the threads, do their work here
+    for (size_t i = spawned + 1; i < workers; ++i) {
+        parallel_chunk_run(&chunks[i]);
+    }
+    return workers;
+}
+
+// Filtered view that shows only the lines containing the pattern
+typedef struct {
+    bool active;
+    Data pattern;
+    Rows rows; // Sorted rows of Editor.lines that contain the pattern
+} Filter;
+
+typedef struct {
+    size_t first; // Row that stays visible and represents the fold
+    size_t last;  // Last row hidden by the fold
+} Fold;
+
+// Folded ranges of rows. They never overlap and are sorted, so the fold that hides
+// a row can be binary searched.
+typedef struct {
+    Fold *items;
+    size_t count;
+    size_t capacity;
+} Folds;
+
+#define BRACKET_KINDS 3
+#define BRACKET_SEGMENT_SIZE 4096
+
+typedef struct Bracket_Summary Bracket_Summary;
+
+typedef struct {
+    Bracket_Summary *items;
+    size_t count;
+    size_t capacity;
+} Bracket_Summaries;
+
+// Segment tree over the bracket depth summaries of the data. The leaves are the lines
+// cut into segments of at most BRACKET_SEGMENT_SIZE bytes, so an edit only invalidates
+// the segments of the edited lines, and the partner of a bracket can be found without
+// scanning everything in between.
+typedef struct {
+    bool valid;
+    Bracket_Summaries leaves;
+    Rows row_starts;        // Index of the first leaf of each row, plus the total amount of leaves at the end
+    Bracket_Summary *nodes; // Implicit tree: node i has the children 2*i and 2*i + 1, leaves start at `size`
+    size_t size;            // Power of two that fits all the leaves
+    size_t nodes_capacity;
+} Brackets;
+
+typedef struct {
+    bool valid;
+    size_t cursor;
+    size_t generation;
+    bool found;
+    size_t partner;
+} Bracket_Match;
+
+#define ANCHOR_NONE SIZE_MAX
+
+typedef struct {
+    size_t max;    // Largest position in the subtree
+    size_t assign; // Pending for the subtree: all the positions become this, unless ANCHOR_NONE
+    size_t add;    // Pending for the subtree after the assignment, the negative shifts wrap around
+} Anchor_Node;
+
+// Positions in the data that follow the edits, like the marks and the places the jumps
+// were made from. The edits never reorder the positions, so they are kept sorted in the
+// leaves of a segment tree with lazy updates, and an edit shifts or collapses any amount
+// of them with O(log n) nodes instead of visiting each one.
+typedef struct {
+    Anchor_Node *nodes; // Implicit tree: node i has the children 2*i and 2*i + 1, leaves start at `size`
+    size_t size;        // Power of two that fits all the leaves
+    size_t count;       // Leaves in use, including the removed anchors until the next rebuild
+    size_t *ids;        // Anchor of each leaf, ANCHOR_NONE if it was removed
+    Offsets leaves;     // Leaf of each anchor, ANCHOR_NONE if it was removed
+} Anchors;
+
+#define WORDS_MAX_INCREMENTAL_SIZE (64*1024)
+
+typedef struct {
+    size_t offset; // Of the spelling in Words.text
+    size_t size;
+    size_t count;  // Occurrences in the buffer
+} Word;
+
+// Sorted index of the words of the buffer for the completion
+typedef struct {
+    bool valid;
+    Word *items;
+    size_t count;
+    size_t capacity;
+    Data text;        // Spellings of the words
+    size_t live_text; // Size of the spellings of the words that are still in the index
+} Words;
+
+#define COMPLETION_CANDIDATES 8
+
+typedef struct {
+    bool active;
+    size_t begin;    // Offset of the word being completed
+    size_t size;     // Current size of that word in the data
+    Data text;       // The typed prefix followed by the candidates
+    size_t ends[COMPLETION_CANDIDATES + 1]; // Ends of the prefix and the candidates in the text
+    size_t count;    // Amount of the candidates
+    size_t selected; // Index in `ends`, 0 is the typed prefix
+} Completion;
+
+#define JSON_NONE UINT32_MAX
+
+// Structural index of a JSON buffer, like the tape of simdjson but without the values.
+// Built in the background by Json_Build.
+typedef struct {
+    size_t *offsets;   // Of the characters {}[],: that are outside of the strings
+    uint32_t *links;   // Partner of each bracket, the opening bracket of the container of each , and :
+    size_t count;
+    size_t capacity;
+    size_t generation; // Of the data the index was built from
+    bool built;
+    size_t error;      // Offset of the first bracket that doesn't match, SIZE_MAX if none
+} Json_Index;
+
+typedef enum {
+    GIT_UNCHANGED = 0,
+    GIT_ADDED,
+    GIT_MODIFIED,
+    GIT_DELETED, // Some lines were deleted right before this one
+} Git_Mark;
+
+// Changes of the buffer against the version of its file in HEAD of the git repository.
+// Computed by Git_Job in the background.
+typedef struct {
+    bool fetched;            // HEAD was read
+    bool tracked;            // The file is in HEAD
+    size_t saved_generation; // Of the buffer when HEAD was read. HEAD is read again after each save.
+    Hashes head;
+    Hashes lines;            // Of the buffer as of the last diff
+    Diff_Matches matches;
+    Data marks;              // Git_Mark of each row
+    size_t generation;       // Of the buffer the marks are for
+} Git_Gutter;
+
+#define COLUMNS_CACHE_SLOTS 256
+#define COLUMNS_MAX_POOL_SIZE (1024*1024)
+#define COLUMNS_MAX_FIELDS 64
+#define COLUMNS_MAX_WIDTH 32
+#define COLUMNS_SEPARATOR " | "
+
+typedef struct {
+    bool cached;
+    size_t row;
+    size_t begin; // Of the offsets of the delimiters of the row in Columns.pool
+    size_t count;
+} Columns_Slot;
+
+// Column view of CSV/TSV. The delimiters are found only in the rows that get rendered or
+// moved through, and cached by the row.
+typedef struct {
+    bool active;
+    char delim;
+    Columns_Slot slots[COLUMNS_CACHE_SLOTS]; // Indexed by the row modulo the amount of slots
+    Offsets pool; // Offsets of the delimiters relative to the beginnings of their lines
+    size_t widths[COLUMNS_MAX_FIELDS]; // Sampled from the rows visible on the last render
+} Columns;
+
+// The session is a binary file with a Session_Header followed by a Session_Buffer
+// for each buffer, which is followed by the path of the file padded to 8 bytes,
+// and the cached Lines and Tabs of the file, if any. The structures are written as
+// they are in memory, so the session can only be restored by the same build.
+#define SESSION_MAGIC "NOEDSES1"
+
+typedef struct {
+    char magic[8];
+    uint64_t line_size; // sizeof(Line) and sizeof(Tab) of the build that wrote the session
+    uint64_t tab_size;
+    uint64_t buffers_count;
+    uint64_t current;
+} Session_Header;
+
+typedef struct {
+    uint64_t path_size;
+    uint64_t cursor;
+    uint64_t view_row;
+    uint64_t view_col;
+    // The cached indices are only valid for this exact version of the file
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t tab_width;
+    uint64_t lines_count; // 0 if the indices are not cached
+    uint64_t tabs_count;
+} Session_Buffer;
+
+#define SESSION_ALIGN(n) (((n) + 7)/8*8)
+
+typedef enum {
+    PROMPT_NONE = 0,
+    PROMPT_FILTER,
+    PROMPT_JUMP_TO_TIME,
+    PROMPT_GREP,
+    PROMPT_FIND_FILE,
+    PROMPT_REPLAY,
+    PROMPT_DIFF,
+    PROMPT_MARK,
+    PROMPT_GOTO_MARK,
+} Prompt_Kind;
+
+typedef struct {
+    Prompt_Kind kind;
+    const char *label;
+    Data text;
+} Prompt;
+
 typedef struct {
     // TODO: replace data with rope
     // I'm not sure if the rope is not gonna be overkill at this point.
@@ -81,55 +470,226 @@ typedef struct {
     // the data into equal chunks, that we lookup with binary search. Then
     // see if it's sufficient.
     Data data;
+    char *file_path;
+    bool scratch; // Not backed by a file, file_path is just the name of the buffer
+    const Session_Buffer *pending; // Restored from the session, but not loaded yet
     Lines lines;
+    Tabs tabs;
+    // Scratch of editor_lines_update()
+    Lines scan_lines;
+    Tabs scan_tabs;
+    size_t tab_width;
+    const char *time_format; // strptime(3) format of the timestamps at the beginning of the lines
     size_t cursor;
     size_t view_row;
     size_t view_col;
+
+    size_t generation; // Incremented on each modification of the data
+    size_t saved_generation; // Generation of the data that is in the file
+    Filter filter;
+    Folds folds;
+    Brackets brackets;
+    Bracket_Match bracket_match;
+    Words words;
+    Completion completion;
+    Columns columns;
+    Json_Index json;
+    Git_Gutter git;
+    Anchors anchors;
+    Prompt prompt;
+    Data status; // One-off message on the status row, cleared on the next key press
 } Editor;
 
+// All the open files. The editor shows one of them at a time.
+typedef struct {
+    Editor **items;
+    size_t count;
+    size_t capacity;
+    size_t current;
+} Buffers;
+
 void editor_free_buffers(Editor *e)
 {
     free(e->data.items);
+    free(e->file_path);
     free(e->lines.items);
+    free(e->tabs.items);
+    free(e->scan_lines.items);
+    free(e->scan_tabs.items);
+    free(e->filter.pattern.items);
+    free(e->filter.rows.items);
+    free(e->folds.items);
+    free(e->brackets.leaves.items);
+    free(e->brackets.row_starts.items);
+    free(e->brackets.nodes);
+    free(e->words.items);
+    free(e->words.text.items);
+    free(e->completion.text.items);
+    free(e->columns.pool.items);
+    free(e->json.offsets);
+    free(e->json.links);
+    free(e->git.head.items);
+    free(e->git.lines.items);
+    free(e->git.matches.items);
+    free(e->git.marks.items);
+    free(e->anchors.nodes);
+    free(e->anchors.ids);
+    free(e->anchors.leaves.items);
+    free(e->prompt.text.items);
+    free(e->status.items);
     e->data.items = NULL;
+    e->file_path = NULL;
     e->lines.items = NULL;
+    e->tabs.items = NULL;
+    e->scan_lines.items = NULL;
+    e->scan_tabs.items = NULL;
+    e->filter.pattern.items = NULL;
+    e->filter.rows.items = NULL;
+    e->folds.items = NULL;
+    e->brackets = (Brackets) {0};
+    e->words = (Words) {0};
+    e->completion.text.items = NULL;
+    e->columns = (Columns) {0};
+    e->json = (Json_Index) {0};
+    e->git = (Git_Gutter) {0};
+    e->anchors = (Anchors) {0};
+    e->prompt.text.items = NULL;
+    e->status.items = NULL;
 }
 
-// TODO: Line recomputation only based on what was changed.
-//
-// For example, if you changed one line, only that line and all of the consequent
-// lines require recomputation. Any lines before the current line basically
-// stay the same.
-//
-// We can even recompute them kinda lazily. We don't really need any lines after
-// `e->view_row + w.ws_row - 1`. So we can only compute them as the view shifts down.
-// We can clearly see that there are some uncomputed lines if
-// `e->lines.items[e->lines.count - 1].end < e->data.count`
-void editor_recompute_lines(Editor *e)
+void editor_set_status(Editor *e, const char *fmt, ...)
 {
-    e->lines.count = 0;
+    e->status.count = 0;
+    va_list args;
+    va_start(args, fmt);
+    data_vappendf(&e->status, fmt, args);
+    va_end(args);
+}
 
-    size_t begin = 0;
-    for (size_t i = 0; i < e->data.count; ++i) {
-        if (e->data.items[i] == '\n') {
-            da_append(&e->lines, ((Line) {
-                .begin = begin,
+// Appends the lines of the data in [begin, end) and their tabs. `begin` must start a line
+// and `end` must end one. The tabs of the lines are counted from `tabs_base`.
+void scan_lines(const Data *data, size_t tab_width, size_t begin, size_t end, size_t tabs_base, Lines *lines, Tabs *tabs)
+{
+    size_t line_begin = begin;
+    size_t tabs_begin = tabs->count;
+    // Visual column of the current position. Only meaningful after the first tab
+    // of the line, because lines without tabs never look at it.
+    size_t col = 0;
+    for (size_t i = begin; i < end; ++i) {
+        if (data->items[i] == '\n') {
+            da_append(lines, ((Line) {
+                .begin = line_begin,
                 .end = i,
+                .tabs_begin = tabs_base + tabs_begin,
+                .tabs_end = tabs_base + tabs->count,
+            }));
+            line_begin = i + 1;
+            tabs_begin = tabs->count;
+        } else if (data->items[i] == '\t') {
+            if (tabs_begin == tabs->count) {
+                col = i - line_begin;
+            } else {
+                Tab *prev = &tabs->items[tabs->count - 1];
+                col = prev->col + (i - prev->offset - 1);
+            }
+            da_append(tabs, ((Tab) {
+                .offset = i,
+                .col = (col/tab_width + 1)*tab_width,
             }));
-            begin = i + 1;
         }
     }
 
+    da_append(lines, ((Line) {
+        .begin = line_begin,
+        .end = end,
+        .tabs_begin = tabs_base + tabs_begin,
+        .tabs_end = tabs_base + tabs->count,
+    }));
+}
+
+// Rescans all the lines of the data. The edits only rescan what they changed with
+// editor_lines_update().
+void editor_recompute_lines(Editor *e)
+{
+    ASSERT(e->tab_width > 0, "Tab width must be set before computing the lines");
+
+    e->lines.count = 0;
+    e->tabs.count = 0;
     // This has an interesting consequence of e->lines always having at least
     // one line even if e->data.count == 0. A lot of code depends on that assumption.
     // We need to be careful if we ever break it.
-    da_append(&e->lines, ((Line) {
-        .begin = begin,
-        .end = e->data.count,
-    }));
+    scan_lines(&e->data, e->tab_width, 0, e->data.count, 0, &e->lines, &e->tabs);
 }
 
-bool editor_open_file(Editor *e, const char *file_path)
+// The data of the rows [first_row, old_last_row] was replaced and the size of the data was
+// `old_size` before that. Rescans only those rows and shifts the lines and the tabs below.
+void editor_lines_update(Editor *e, size_t first_row, size_t old_last_row, size_t old_size)
+{
+    size_t begin = e->lines.items[first_row].begin;
+    // The offsets below the edit are shifted with the wrapping arithmetic, which also works
+    // when the data shrinks
+    size_t shift = e->data.count - old_size;
+    size_t end = e->lines.items[old_last_row].end + shift;
+    size_t tabs_begin = e->lines.items[first_row].tabs_begin;
+    size_t tabs_end = e->lines.items[old_last_row].tabs_end;
+
+    e->scan_lines.count = 0;
+    e->scan_tabs.count = 0;
+    scan_lines(&e->data, e->tab_width, begin, end, tabs_begin, &e->scan_lines, &e->scan_tabs);
+
+    size_t tabs_tail = e->tabs.count - tabs_end;
+    size_t new_tabs_end = tabs_begin + e->scan_tabs.count;
+    da_reserve(&e->tabs, new_tabs_end + tabs_tail);
+    memmove(e->tabs.items + new_tabs_end, e->tabs.items + tabs_end, tabs_tail*sizeof(*e->tabs.items));
+    memcpy(e->tabs.items + tabs_begin, e->scan_tabs.items, e->scan_tabs.count*sizeof(*e->tabs.items));
+    e->tabs.count = new_tabs_end + tabs_tail;
+    for (size_t i = new_tabs_end; i < e->tabs.count; ++i) {
+        e->tabs.items[i].offset += shift;
+    }
+
+    size_t tail = e->lines.count - (old_last_row + 1);
+    size_t new_lines_end = first_row + e->scan_lines.count;
+    da_reserve(&e->lines, new_lines_end + tail);
+    memmove(e->lines.items + new_lines_end, e->lines.items + old_last_row + 1, tail*sizeof(*e->lines.items));
+    memcpy(e->lines.items + first_row, e->scan_lines.items, e->scan_lines.count*sizeof(*e->lines.items));
+    e->lines.count = new_lines_end + tail;
+    size_t tabs_shift = new_tabs_end - tabs_end;
+    for (size_t i = new_lines_end; i < e->lines.count; ++i) {
+        Line *line = &e->lines.items[i];
+        line->begin += shift;
+        line->end += shift;
+        line->tabs_begin += tabs_shift;
+        line->tabs_end += tabs_shift;
+    }
+}
+
+// Visual column of the position `offset` that belongs to the line `row`.
+size_t editor_visual_col(const Editor *e, size_t row, size_t offset)
+{
+    const Line *line = &e->lines.items[row];
+    ASSERT(line->begin <= offset && offset <= line->end, "offset %zu does not belong to the line %zu", offset, row);
+
+    // Binary search the last tab before the offset
+    size_t lo = line->tabs_begin;
+    size_t hi = line->tabs_end;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (e->tabs.items[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == line->tabs_begin) return offset - line->begin;
+    const Tab *tab = &e->tabs.items[lo - 1];
+    return tab->col + (offset - tab->offset - 1);
+}
+
+// Reads the file into e->data. The errors go to the status of the editor, the terminal
+// may be showing the editor already. A file that doesn't exist is read as empty, it is
+// created when saved.
+bool editor_read_file(Editor *e, const char *file_path)
 {
     bool result = true;
     int fd = -1;
@@ -142,19 +702,19 @@ bool editor_open_file(Editor *e, const char *file_path)
         if (errno == ENOENT) {
             return_defer(true);
         } else {
-            fprintf(stderr, "ERROR: could not determine if file %s exists\n", file_path);
+            editor_set_status(e, "Could not determine if file %s exists: %s", file_path, strerror(errno));
             return_defer(false);
         }
     }
 
     if ((statbuf.st_mode & S_IFMT) != S_IFREG) {
-        fprintf(stderr, "ERROR: %s is not a regular file\n", file_path);
+        editor_set_status(e, "%s is not a regular file", file_path);
         return_defer(false);
     }
 
     fd = open(file_path, O_RDONLY);
     if (fd < 0) {
-        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        editor_set_status(e, "Could not open file %s: %s", file_path, strerror(errno));
         return_defer(false);
     }
 
@@ -163,13 +723,13 @@ bool editor_open_file(Editor *e, const char *file_path)
 
     ssize_t n = read(fd, e->data.items, file_size);
     if (n < 0) {
-        fprintf(stderr, "ERROR: could not read file %s: %s\n", file_path, strerror(errno));
+        editor_set_status(e, "Could not read file %s: %s", file_path, strerror(errno));
         return_defer(false);
     }
     while ((size_t) n < file_size) {
         ssize_t m = read(fd, e->data.items + n, file_size - n);
         if (m < 0) {
-            fprintf(stderr, "ERROR: could not read file %s: %s\n", file_path, strerror(errno));
+            editor_set_status(e, "Could not read file %s: %s", file_path, strerror(errno));
             return_defer(false);
         }
         n += m;
@@ -178,295 +738,5895 @@ bool editor_open_file(Editor *e, const char *file_path)
     e->data.count = n;
 
 defer:
-    if (result) editor_recompute_lines(e);
     if (fd >= 0) close(fd);
     return result;
 }
 
-void editor_insert_char(Editor *e, char x)
+bool editor_open_file(Editor *e, const char *file_path)
 {
-    if (e->cursor > e->data.count) e->cursor = e->data.count;
-    da_append(&e->data, '\0');
-    memmove(&e->data.items[e->cursor + 1], &e->data.items[e->cursor], e->data.count - 1 - e->cursor);
-    e->data.items[e->cursor] = x;
-    e->cursor += 1;
+    if (!editor_read_file(e, file_path)) return false;
+    free(e->file_path);
+    e->file_path = strdup(file_path);
+    ASSERT(e->file_path != NULL, "Buy more RAM lol");
+    e->saved_generation = e->generation;
     editor_recompute_lines(e);
+    return true;
 }
 
-void editor_delete_char(Editor *e)
+size_t session_buffer_size(const Session_Buffer *b)
 {
-    if (e->cursor < e->data.count) {
-        memmove(&e->data.items[e->cursor], &e->data.items[e->cursor + 1], e->data.count - e->cursor - 1);
-        e->data.count -= 1;
-        editor_recompute_lines(e);
-    }
+    return sizeof(*b) + SESSION_ALIGN(b->path_size) + b->lines_count*sizeof(Line) + b->tabs_count*sizeof(Tab);
 }
 
-void editor_backdelete_char(Editor *e)
+// The counts come from the file, so they are checked against the available size one
+// by one before anything is multiplied and could wrap around
+bool session_buffer_fits(const Session_Buffer *b, size_t available)
 {
-    if (0 < e->cursor && e->cursor <= e->data.count) {
-        memmove(&e->data.items[e->cursor - 1], &e->data.items[e->cursor], e->data.count - e->cursor);
-        e->data.count -= 1;
-        e->cursor -= 1;
+    if (available < sizeof(*b) || b->path_size >= PATH_MAX) return false;
+    available -= sizeof(*b);
+    if (available < SESSION_ALIGN(b->path_size)) return false;
+    available -= SESSION_ALIGN(b->path_size);
+    if (b->lines_count > available/sizeof(Line)) return false;
+    available -= b->lines_count*sizeof(Line);
+    return b->tabs_count <= available/sizeof(Tab);
+}
+
+// Reads the file of the buffer restored from the session. If the file did not
+// change since the session was saved, the cached indices are copied from the
+// session instead of scanning the file.
+void editor_load_pending(Editor *e)
+{
+    const Session_Buffer *b = e->pending;
+    if (b == NULL) return;
+    e->pending = NULL;
+
+    const char *indices = (const char *) (b + 1) + SESSION_ALIGN(b->path_size);
+    const Line *lines = (const Line *) indices;
+    const Tab *tabs = (const Tab *) (indices + b->lines_count*sizeof(Line));
+
+    struct stat statbuf;
+    if (stat(e->file_path, &statbuf) < 0 || !editor_read_file(e, e->file_path)) {
+        editor_set_status(e, "Could not read %s", e->file_path);
+        e->data.count = 0;
         editor_recompute_lines(e);
+        return;
     }
+    e->saved_generation = e->generation;
+
+    bool cached = b->lines_count > 0 &&
+        b->file_size == e->data.count &&
+        (uint64_t) statbuf.st_size == b->file_size &&
+        statbuf.st_mtim.tv_sec == b->mtime_sec &&
+        statbuf.st_mtim.tv_nsec == b->mtime_nsec &&
+        b->tab_width == e->tab_width &&
+        lines[b->lines_count - 1].end == e->data.count;
+    if (cached) {
+        da_reserve(&e->lines, b->lines_count);
+        memcpy(e->lines.items, lines, b->lines_count*sizeof(Line));
+        e->lines.count = b->lines_count;
+        e->tabs.count = 0;
+        da_reserve(&e->tabs, b->tabs_count);
+        memcpy(e->tabs.items, tabs, b->tabs_count*sizeof(Tab));
+        e->tabs.count = b->tabs_count;
+    } else {
+        editor_recompute_lines(e);
+    }
+
+    e->cursor = b->cursor <= e->data.count ? b->cursor : e->data.count;
+    e->view_row = b->view_row < e->lines.count ? b->view_row : e->lines.count - 1;
+    e->view_col = b->view_col;
 }
 
-size_t editor_current_line(const Editor *e)
+size_t editor_row_of(const Editor *e, size_t offset)
 {
-    ASSERT(e->cursor <= e->data.count, "cursor: %zu, size: %zu", e->cursor, e->data.count);
+    ASSERT(offset <= e->data.count, "offset: %zu, size: %zu", offset, e->data.count);
     ASSERT(e->lines.count >= 1, "editor_recompute_lines() guarantees there there is at least one line. Make sure you called it.");
-    for (size_t i = 0; i < e->lines.count; ++i) {
-        if (e->lines.items[i].begin <= e->cursor && e->cursor <= e->lines.items[i].end) {
-            return i;
+    // Binary search the last line that begins at or before the offset
+    size_t lo = 0;
+    size_t hi = e->lines.count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        if (e->lines.items[mid].begin <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
     }
-    return 0;
+    return lo;
 }
 
-typedef struct {
-    char *chars;
-    size_t cursor_row, cursor_col;
-    size_t rows, cols;
-} Display;
+size_t editor_current_line(const Editor *e)
+{
+    return editor_row_of(e, e->cursor);
+}
 
-void editor_rerender(Editor *e, bool insert, Display *d)
+// The empty line after the last newline is not a line of the file
+size_t editor_file_lines_count(const Editor *e)
 {
-    const char *insert_label = "-- INSERT --";
+    const Line *last = &e->lines.items[e->lines.count - 1];
+    return last->begin == last->end ? e->lines.count - 1 : e->lines.count;
+}
 
-    for (size_t i = 0; i < d->rows*d->cols; ++i) {
-        d->chars[i] = ' ';
+// First index in the sorted rows that is not less than row
+size_t rows_lower_bound(const Rows *rows, size_t row)
+{
+    size_t lo = 0;
+    size_t hi = rows->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (rows->items[mid] < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    return lo;
+}
 
-    size_t rows = d->rows;
-    size_t cols = d->cols;
+bool editor_line_contains(const Editor *e, size_t row, const char *needle, size_t needle_size)
+{
+    const Line *line = &e->lines.items[row];
+    return memmem(e->data.items + line->begin, line->end - line->begin, needle, needle_size) != NULL;
+}
 
-    if (rows < 2 || cols < strlen(insert_label)) return;
+// The rows [first_row, old_last_row] were replaced by the rows [first_row, new_last_row].
+// Rematches only them and shifts the matches below.
+void editor_filter_update(Editor *e, size_t first_row, size_t old_last_row, size_t new_last_row)
+{
+    Filter *f = &e->filter;
+    if (!f->active) return;
 
-    rows -= 1;
+    size_t lo = rows_lower_bound(&f->rows, first_row);
+    size_t hi = rows_lower_bound(&f->rows, old_last_row + 1);
 
-    size_t cursor_row = editor_current_line(e);
-    size_t cursor_col = e->cursor - e->lines.items[cursor_row].begin;
-    if (cursor_row < e->view_row) {
-        e->view_row = cursor_row;
+    size_t matches[64];
+    size_t matches_count = 0;
+    size_t row = first_row;
+    while (row <= new_last_row) {
+        // A single edit does not produce that many lines, but if it does we just insert
+        // the matches in several batches.
+        matches_count = 0;
+        for (; row <= new_last_row && matches_count < sizeof(matches)/sizeof(matches[0]); ++row) {
+            if (editor_line_contains(e, row, f->pattern.items, f->pattern.count)) {
+                matches[matches_count++] = row;
+            }
+        }
+
+        size_t tail = f->rows.count - hi;
+        size_t new_count = lo + matches_count + tail;
+        da_reserve(&f->rows, new_count);
+        memmove(f->rows.items + lo + matches_count, f->rows.items + hi, tail*sizeof(*f->rows.items));
+        memcpy(f->rows.items + lo, matches, matches_count*sizeof(*matches));
+        f->rows.count = new_count;
+        lo += matches_count;
+        hi = lo;
     }
-    if (cursor_row >= e->view_row + rows) {
-        e->view_row = cursor_row - rows + 1;
+
+    for (size_t i = hi; i < f->rows.count; ++i) {
+        f->rows.items[i] = f->rows.items[i] - old_last_row + new_last_row;
     }
+}
 
-    if (cursor_col < e->view_col) {
-        e->view_col = cursor_col;
+// Index of the first fold that begins after the row
+size_t editor_folds_upper_bound(const Editor *e, size_t row)
+{
+    size_t lo = 0;
+    size_t hi = e->folds.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (e->folds.items[mid].first <= row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    if (cursor_col >= e->view_col + cols) {
-        e->view_col = cursor_col - cols + 1;
+    return lo;
+}
+
+// The fold that hides the row, or NULL if the row is not hidden
+const Fold *editor_fold_hiding(const Editor *e, size_t row)
+{
+    size_t i = editor_folds_upper_bound(e, row);
+    if (i == 0) return NULL;
+    const Fold *fold = &e->folds.items[i - 1];
+    return fold->first < row && row <= fold->last ? fold : NULL;
+}
+
+// The fold represented by the row, or NULL if the row does not start a fold
+const Fold *editor_fold_at(const Editor *e, size_t row)
+{
+    size_t i = editor_folds_upper_bound(e, row);
+    if (i == 0) return NULL;
+    const Fold *fold = &e->folds.items[i - 1];
+    return fold->first == row ? fold : NULL;
+}
+
+// Same contract as editor_filter_update()
+void editor_folds_update(Editor *e, size_t first_row, size_t old_last_row, size_t new_last_row)
+{
+    size_t i = 0;
+    for (size_t j = 0; j < e->folds.count; ++j) {
+        Fold fold = e->folds.items[j];
+        if (fold.first > old_last_row) {
+            fold.first = fold.first - old_last_row + new_last_row;
+            fold.last = fold.last - old_last_row + new_last_row;
+        } else if (fold.last >= first_row) {
+            // The fold intersects the edited rows
+            if (fold.first > first_row) fold.first = first_row;
+            fold.last = fold.last >= old_last_row ? fold.last - old_last_row + new_last_row : new_last_row;
+            if (fold.last <= fold.first) continue;
+        }
+        e->folds.items[i++] = fold;
     }
+    e->folds.count = i;
+}
 
-    for (size_t i = 0; i < rows; ++i) {
-        size_t row = e->view_row + i;
-        if (row < e->lines.count) {
-            const char *line_start = e->data.items + e->lines.items[row].begin;
-            size_t line_size = e->lines.items[row].end - e->lines.items[row].begin;
-            size_t view_col = e->view_col;
-            if (view_col > line_size) view_col = line_size;
-            line_start += view_col;
-            line_size -= view_col;
-            if (line_size > cols) line_size = cols;
-            memcpy(d->chars + i*d->cols, line_start, line_size);
+// Summary of the bracket depth over a piece of the data, one channel per kind of
+// brackets. `min` is the lowest depth reached within the piece (including its both
+// ends) relative to the depth at its beginning, so it is never positive.
+struct Bracket_Summary {
+    int32_t delta[BRACKET_KINDS];
+    int32_t min[BRACKET_KINDS];
+};
+
+static const char bracket_opens[BRACKET_KINDS] = {'(', '[', '{'};
+static const char bracket_closes[BRACKET_KINDS] = {')', ']', '}'};
+
+// Returns the kind of the bracket and whether it opens, or -1 if x is not a bracket
+int bracket_kind(char x, bool *opens)
+{
+    for (int kind = 0; kind < BRACKET_KINDS; ++kind) {
+        if (x == bracket_opens[kind]) {
+            *opens = true;
+            return kind;
+        }
+        if (x == bracket_closes[kind]) {
+            *opens = false;
+            return kind;
+        }
+    }
+    return -1;
+}
+
+Bracket_Summary bracket_summary_of(const char *data, size_t size)
+{
+    Bracket_Summary s = {0};
+    for (size_t i = 0; i < size; ++i) {
+        bool opens;
+        int kind = bracket_kind(data[i], &opens);
+        if (kind < 0) continue;
+        if (opens) {
+            s.delta[kind] += 1;
         } else {
-            memcpy(d->chars + i*d->cols, "~", 1);
+            s.delta[kind] -= 1;
+            if (s.delta[kind] < s.min[kind]) s.min[kind] = s.delta[kind];
         }
     }
+    return s;
+}
 
-    if (insert) {
-        memcpy(d->chars + rows*d->cols, insert_label, strlen(insert_label));
+Bracket_Summary bracket_summary_combine(Bracket_Summary a, Bracket_Summary b)
+{
+    Bracket_Summary s;
+    for (int kind = 0; kind < BRACKET_KINDS; ++kind) {
+        s.delta[kind] = a.delta[kind] + b.delta[kind];
+        s.min[kind] = a.delta[kind] + b.min[kind] < a.min[kind] ? a.delta[kind] + b.min[kind] : a.min[kind];
     }
+    return s;
+}
 
-    if (cursor_col > cols) cursor_col = cols;
-    d->cursor_row = cursor_row - e->view_row;
-    d->cursor_col = cursor_col;
+size_t editor_row_segments_count(const Editor *e, size_t row)
+{
+    size_t size = e->lines.items[row].end - e->lines.items[row].begin;
+    return size == 0 ? 1 : (size + BRACKET_SEGMENT_SIZE - 1)/BRACKET_SEGMENT_SIZE;
 }
 
-bool editor_save_to_file(Editor *e, const char *file_path)
+// Range of the data covered by the leaf of the bracket tree
+void editor_bracket_segment(const Editor *e, size_t leaf, size_t *begin, size_t *end)
 {
-    bool result = true;
-    int fd = open(file_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (fd < 0) {
-        // TODO: we need to log something here,
-        // but we can't easily do that if we are already in the special terminal mode with
-        // no ECHO and no ICANON (it will just look weird).
-        //
-        // Maybe we could start bubbling up errors through return values like in Go? But that may
-        // require dynamic memory management.
-        //
-        // We can just create a dedicated arena for the bubbling errors. I had this idea for quite some
-        // time already, maybe we can test it in here.
-        fprintf(stderr, "ERROR: could not open file %s for writing: %s\n", file_path, strerror(errno));
+    const Rows *starts = &e->brackets.row_starts;
+    // Binary search the row of the leaf
+    size_t lo = 0;
+    size_t hi = e->lines.count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        if (starts->items[mid] <= leaf) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const Line *line = &e->lines.items[lo];
+    *begin = line->begin + (leaf - starts->items[lo])*BRACKET_SEGMENT_SIZE;
+    *end = *begin + BRACKET_SEGMENT_SIZE;
+    if (*end > line->end) *end = line->end;
+}
+
+void editor_brackets_rebuild_tree(Editor *e)
+{
+    Brackets *b = &e->brackets;
+    size_t size = 1;
+    while (size < b->leaves.count) size *= 2;
+    if (2*size > b->nodes_capacity) {
+        b->nodes_capacity = 2*size;
+        b->nodes = realloc(b->nodes, b->nodes_capacity*sizeof(*b->nodes));
+        ASSERT(b->nodes != NULL, "Buy more RAM lol");
+    }
+    b->size = size;
+    memcpy(b->nodes + size, b->leaves.items, b->leaves.count*sizeof(*b->nodes));
+    memset(b->nodes + size + b->leaves.count, 0, (size - b->leaves.count)*sizeof(*b->nodes));
+    for (size_t i = size - 1; i >= 1; --i) {
+        b->nodes[i] = bracket_summary_combine(b->nodes[2*i], b->nodes[2*i + 1]);
+    }
+}
+
+void editor_brackets_recompute_leaves(Editor *e, size_t first_row, size_t last_row)
+{
+    Brackets *b = &e->brackets;
+    for (size_t row = first_row; row <= last_row; ++row) {
+        for (size_t leaf = b->row_starts.items[row]; leaf < b->row_starts.items[row + 1]; ++leaf) {
+            size_t begin, end;
+            editor_bracket_segment(e, leaf, &begin, &end);
+            b->leaves.items[leaf] = bracket_summary_of(e->data.items + begin, end - begin);
+        }
+    }
+}
+
+void brackets_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    UNUSED(worker);
+    Editor *e = ctx;
+    if (begin < end) editor_brackets_recompute_leaves(e, begin, end - 1);
+}
+
+void editor_brackets_build(Editor *e)
+{
+    Brackets *b = &e->brackets;
+    b->row_starts.count = 0;
+    size_t leaves_count = 0;
+    for (size_t row = 0; row < e->lines.count; ++row) {
+        da_append(&b->row_starts, leaves_count);
+        leaves_count += editor_row_segments_count(e, row);
+    }
+    da_append(&b->row_starts, leaves_count);
+
+    b->leaves.count = 0;
+    da_reserve(&b->leaves, leaves_count);
+    b->leaves.count = leaves_count;
+    parallel_for(e->lines.count, 64*1024, e, brackets_job);
+
+    editor_brackets_rebuild_tree(e);
+    b->valid = true;
+}
+
+// Same contract as editor_filter_update(). Edits that do not change the amount of
+// segments only recompute the segments of the edited rows and their ancestors in the
+// tree. Otherwise the leaves are shifted and the tree is rebuilt from them, which
+// still does not look at the data outside of the edited rows.
+void editor_brackets_update(Editor *e, size_t first_row, size_t old_last_row, size_t new_last_row)
+{
+    Brackets *b = &e->brackets;
+    if (!b->valid) return;
+
+    size_t old_begin = b->row_starts.items[first_row];
+    size_t old_end = b->row_starts.items[old_last_row + 1];
+    size_t new_count = 0;
+    for (size_t row = first_row; row <= new_last_row; ++row) {
+        new_count += editor_row_segments_count(e, row);
+    }
+
+    if (old_last_row == new_last_row && new_count == old_end - old_begin) {
+        editor_brackets_recompute_leaves(e, first_row, new_last_row);
+        for (size_t leaf = old_begin; leaf < old_end; ++leaf) {
+            size_t node = b->size + leaf;
+            b->nodes[node] = b->leaves.items[leaf];
+            for (node /= 2; node >= 1; node /= 2) {
+                b->nodes[node] = bracket_summary_combine(b->nodes[2*node], b->nodes[2*node + 1]);
+            }
+        }
+        return;
+    }
+
+    // Shift the leaves after the edited rows
+    size_t tail = b->leaves.count - old_end;
+    da_reserve(&b->leaves, old_begin + new_count + tail);
+    memmove(b->leaves.items + old_begin + new_count, b->leaves.items + old_end, tail*sizeof(*b->leaves.items));
+    b->leaves.count = old_begin + new_count + tail;
+
+    // Shift the starts of the rows after the edited rows
+    size_t rows_tail = b->row_starts.count - (old_last_row + 1);
+    da_reserve(&b->row_starts, new_last_row + 1 + rows_tail);
+    memmove(b->row_starts.items + new_last_row + 1, b->row_starts.items + old_last_row + 1, rows_tail*sizeof(*b->row_starts.items));
+    b->row_starts.count = new_last_row + 1 + rows_tail;
+    for (size_t row = new_last_row + 1; row < b->row_starts.count; ++row) {
+        b->row_starts.items[row] = b->row_starts.items[row] - old_end + old_begin + new_count;
+    }
+    size_t leaf = old_begin;
+    for (size_t row = first_row; row <= new_last_row; ++row) {
+        b->row_starts.items[row] = leaf;
+        leaf += editor_row_segments_count(e, row);
+    }
+
+    editor_brackets_recompute_leaves(e, first_row, new_last_row);
+    editor_brackets_rebuild_tree(e);
+}
+
+// First leaf in [from, ...) where the depth, starting from `*depth` at `from`, goes
+// below zero. Updates `*depth` to the depth at the beginning of that leaf.
+size_t bracket_tree_find_forward(const Brackets *b, int kind, size_t node, size_t lo, size_t hi, size_t from, int32_t *depth)
+{
+    if (hi <= from) return SIZE_MAX;
+    if (lo >= from) {
+        if (*depth + b->nodes[node].min[kind] >= 0) {
+            *depth += b->nodes[node].delta[kind];
+            return SIZE_MAX;
+        }
+        if (hi - lo == 1) return lo;
+    }
+    size_t mid = lo + (hi - lo)/2;
+    size_t result = bracket_tree_find_forward(b, kind, 2*node, lo, mid, from, depth);
+    if (result != SIZE_MAX) return result;
+    return bracket_tree_find_forward(b, kind, 2*node + 1, mid, hi, from, depth);
+}
+
+// Last leaf in (..., from] where the depth, going backwards and starting from `*depth`
+// at the end of `from`, goes below zero. Going backwards the closing brackets increase
+// the depth, so the lowest depth of a piece read backwards is its min - delta.
+size_t bracket_tree_find_backward(const Brackets *b, int kind, size_t node, size_t lo, size_t hi, size_t from, int32_t *depth)
+{
+    if (lo > from) return SIZE_MAX;
+    if (hi <= from + 1) {
+        if (*depth + b->nodes[node].min[kind] - b->nodes[node].delta[kind] >= 0) {
+            *depth -= b->nodes[node].delta[kind];
+            return SIZE_MAX;
+        }
+        if (hi - lo == 1) return lo;
+    }
+    size_t mid = lo + (hi - lo)/2;
+    size_t result = bracket_tree_find_backward(b, kind, 2*node + 1, mid, hi, from, depth);
+    if (result != SIZE_MAX) return result;
+    return bracket_tree_find_backward(b, kind, 2*node, lo, mid, from, depth);
+}
+
+// Finds the partner of the bracket at the offset in O(log n) by scanning at most
+// the segment of the bracket and the segment of the partner.
+bool editor_find_matching_bracket(Editor *e, size_t offset, size_t *result)
+{
+    if (offset >= e->data.count) return false;
+    bool opens;
+    int kind = bracket_kind(e->data.items[offset], &opens);
+    if (kind < 0) return false;
+
+    Brackets *b = &e->brackets;
+    if (!b->valid) editor_brackets_build(e);
+
+    size_t row = editor_row_of(e, offset);
+    size_t leaf = b->row_starts.items[row] + (offset - e->lines.items[row].begin)/BRACKET_SEGMENT_SIZE;
+    size_t begin, end;
+    editor_bracket_segment(e, leaf, &begin, &end);
+
+    int32_t depth = 0;
+    if (opens) {
+        for (size_t i = offset + 1;; ++i) {
+            for (; i < end; ++i) {
+                if (e->data.items[i] == bracket_opens[kind]) depth += 1;
+                if (e->data.items[i] == bracket_closes[kind]) depth -= 1;
+                if (depth < 0) {
+                    *result = i;
+                    return true;
+                }
+            }
+            if (leaf + 1 >= b->leaves.count) return false;
+            leaf = bracket_tree_find_forward(b, kind, 1, 0, b->size, leaf + 1, &depth);
+            if (leaf == SIZE_MAX) return false;
+            editor_bracket_segment(e, leaf, &begin, &end);
+            i = begin - 1;
+        }
+    } else {
+        for (size_t i = offset;;) {
+            for (; i > begin; --i) {
+                if (e->data.items[i - 1] == bracket_closes[kind]) depth += 1;
+                if (e->data.items[i - 1] == bracket_opens[kind]) depth -= 1;
+                if (depth < 0) {
+                    *result = i - 1;
+                    return true;
+                }
+            }
+            if (leaf == 0) return false;
+            leaf = bracket_tree_find_backward(b, kind, 1, 0, b->size, leaf - 1, &depth);
+            if (leaf == SIZE_MAX) return false;
+            editor_bracket_segment(e, leaf, &begin, &end);
+            i = end;
+        }
+    }
+}
+
+// Partner of the bracket under the cursor. The result is cached until the cursor
+// moves or the data changes, so highlighting it on every frame is free.
+bool editor_cursor_bracket_partner(Editor *e, size_t *partner)
+{
+    Bracket_Match *m = &e->bracket_match;
+    if (!m->valid || m->cursor != e->cursor || m->generation != e->generation) {
+        m->valid = true;
+        m->cursor = e->cursor;
+        m->generation = e->generation;
+        m->found = editor_find_matching_bracket(e, e->cursor, &m->partner);
+    }
+    *partner = m->partner;
+    return m->found;
+}
+
+bool is_word_char(char x)
+{
+    return isalnum((unsigned char) x) || x == '_';
+}
+
+int word_compare(const char *a, size_t a_size, const char *b, size_t b_size)
+{
+    int cmp = memcmp(a, b, a_size < b_size ? a_size : b_size);
+    if (cmp != 0) return cmp;
+    return (a_size > b_size) - (a_size < b_size);
+}
+
+// Index of the first word that is not less than the key
+size_t words_lower_bound(const Words *w, const char *key, size_t key_size)
+{
+    size_t lo = 0;
+    size_t hi = w->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        const Word *word = &w->items[mid];
+        if (word_compare(w->text.items + word->offset, word->size, key, key_size) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void words_add(Words *w, const char *word, size_t size)
+{
+    size_t i = words_lower_bound(w, word, size);
+    if (i < w->count && word_compare(w->text.items + w->items[i].offset, w->items[i].size, word, size) == 0) {
+        w->items[i].count += 1;
+        return;
+    }
+    Word new_word = { .offset = w->text.count, .size = size, .count = 1 };
+    da_append_many(&w->text, word, size);
+    da_append(w, new_word);
+    memmove(&w->items[i + 1], &w->items[i], (w->count - 1 - i)*sizeof(*w->items));
+    w->items[i] = new_word;
+    w->live_text += size;
+}
+
+void words_remove(Words *w, const char *word, size_t size)
+{
+    size_t i = words_lower_bound(w, word, size);
+    if (i >= w->count || word_compare(w->text.items + w->items[i].offset, w->items[i].size, word, size) != 0) return;
+    w->items[i].count -= 1;
+    if (w->items[i].count > 0) return;
+    memmove(&w->items[i], &w->items[i + 1], (w->count - i - 1)*sizeof(*w->items));
+    w->count -= 1;
+    w->live_text -= size;
+    // The spellings of the removed words stay in the text. Start over once they take
+    // more space than the live ones.
+    if (w->text.count > 2*w->live_text + 64*1024) w->valid = false;
+}
+
+// Adds (or removes) the words of the rows [first_row, last_row] to the index. Called
+// by editor_splice() for the edited rows before and after the edit. Large edits
+// just drop the index, so it is rebuilt from scratch when it is needed again.
+void editor_words_update(Editor *e, size_t first_row, size_t last_row, bool add)
+{
+    Words *w = &e->words;
+    if (!w->valid) return;
+
+    size_t begin = e->lines.items[first_row].begin;
+    size_t end = e->lines.items[last_row].end;
+    if (end - begin > WORDS_MAX_INCREMENTAL_SIZE) {
+        w->valid = false;
+        return;
+    }
+
+    for (size_t i = begin; i < end;) {
+        if (!is_word_char(e->data.items[i])) {
+            i += 1;
+            continue;
+        }
+        size_t start = i;
+        while (i < end && is_word_char(e->data.items[i])) i += 1;
+        if (add) {
+            words_add(w, e->data.items + start, i - start);
+        } else {
+            words_remove(w, e->data.items + start, i - start);
+        }
+    }
+}
+
+typedef struct {
+    const Editor *e;
+    // Sorted words of each worker with the offsets pointing into the data
+    Words results[MAX_WORKERS];
+} Words_Job;
+
+int word_occurrence_compare(const void *a, const void *b, void *ctx)
+{
+    const char *data = ctx;
+    const Word *x = a;
+    const Word *y = b;
+    return word_compare(data + x->offset, x->size, data + y->offset, y->size);
+}
+
+void words_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    Words_Job *job = ctx;
+    const Editor *e = job->e;
+    Words *w = &job->results[worker];
+    if (begin >= end) return;
+
+    size_t data_end = e->lines.items[end - 1].end;
+    for (size_t i = e->lines.items[begin].begin; i < data_end;) {
+        if (!is_word_char(e->data.items[i])) {
+            i += 1;
+            continue;
+        }
+        size_t start = i;
+        while (i < data_end && is_word_char(e->data.items[i])) i += 1;
+        Word word = { .offset = start, .size = i - start, .count = 1 };
+        da_append(w, word);
+    }
+
+    qsort_r(w->items, w->count, sizeof(*w->items), word_occurrence_compare, e->data.items);
+    size_t n = 0;
+    for (size_t i = 0; i < w->count; ++i) {
+        if (n > 0 && word_occurrence_compare(&w->items[n - 1], &w->items[i], e->data.items) == 0) {
+            w->items[n - 1].count += 1;
+        } else {
+            w->items[n++] = w->items[i];
+        }
+    }
+    w->count = n;
+}
+
+// Each worker collects and sorts the words of its chunk of lines, then the sorted
+// chunks are merged into the index.
+void editor_words_build(Editor *e)
+{
+    Words *w = &e->words;
+    w->count = 0;
+    w->text.count = 0;
+    w->live_text = 0;
+
+    Words_Job job = { .e = e };
+    size_t workers = parallel_for(e->lines.count, 64*1024, &job, words_job);
+
+    size_t heads[MAX_WORKERS] = {0};
+    for (;;) {
+        const Word *min = NULL;
+        for (size_t i = 0; i < workers; ++i) {
+            if (heads[i] >= job.results[i].count) continue;
+            const Word *head = &job.results[i].items[heads[i]];
+            if (min == NULL || word_occurrence_compare(head, min, e->data.items) < 0) min = head;
+        }
+        if (min == NULL) break;
+
+        Word word = { .offset = w->text.count, .size = min->size, .count = 0 };
+        da_append_many(&w->text, e->data.items + min->offset, min->size);
+        Word key = *min;
+        for (size_t i = 0; i < workers; ++i) {
+            if (heads[i] >= job.results[i].count) continue;
+            const Word *head = &job.results[i].items[heads[i]];
+            if (word_occurrence_compare(head, &key, e->data.items) == 0) {
+                word.count += head->count;
+                heads[i] += 1;
+            }
+        }
+        da_append(w, word);
+        w->live_text += word.size;
+    }
+
+    for (size_t i = 0; i < workers; ++i) {
+        free(job.results[i].items);
+    }
+    w->valid = true;
+}
+
+// Finds up to `capacity` of the most frequent words that start with the prefix and
+// are longer than it. Puts their indices into `result` and returns their amount.
+size_t editor_complete_word(Editor *e, const char *prefix, size_t prefix_size, size_t *result, size_t capacity)
+{
+    Words *w = &e->words;
+    if (!w->valid) editor_words_build(e);
+
+    size_t n = 0;
+    for (size_t i = words_lower_bound(w, prefix, prefix_size); i < w->count; ++i) {
+        const Word *word = &w->items[i];
+        if (word->size < prefix_size || memcmp(w->text.items + word->offset, prefix, prefix_size) != 0) break;
+        if (word->size == prefix_size) continue;
+        // Insertion into the top sorted by the count
+        size_t j = n < capacity ? n++ : capacity;
+        while (j > 0 && w->items[result[j - 1]].count < word->count) {
+            if (j < capacity) result[j] = result[j - 1];
+            j -= 1;
+        }
+        if (j < capacity) result[j] = i;
+    }
+    return n;
+}
+
+// Appends the offsets of the delimiters of the line that are not inside of the quotes
+void scan_delims(const char *line, size_t size, char delim, Offsets *delims)
+{
+    // Up to the first quote memchr(3) can jump from a delimiter right to the next one
+    const char *quote = memchr(line, '"', size);
+    size_t plain_size = quote ? (size_t) (quote - line) : size;
+    for (const char *p = memchr(line, delim, plain_size); p != NULL; p = memchr(p + 1, delim, line + plain_size - p - 1)) {
+        da_append(delims, p - line);
+    }
+    // "" in a quoted field toggles the quoting twice, so it just works
+    bool quoted = false;
+    for (size_t i = plain_size; i < size; ++i) {
+        if (line[i] == '"') {
+            quoted = !quoted;
+        } else if (line[i] == delim && !quoted) {
+            da_append(delims, i);
+        }
+    }
+}
+
+// Offsets of the delimiters of the row relative to its beginning
+const size_t *editor_row_delims(Editor *e, size_t row, size_t *count)
+{
+    Columns *c = &e->columns;
+    Columns_Slot *slot = &c->slots[row%COLUMNS_CACHE_SLOTS];
+    if (!slot->cached || slot->row != row) {
+        // The slots that were replaced or invalidated leave garbage in the pool, so once in
+        // a while it is collected all at once
+        if (c->pool.count > COLUMNS_MAX_POOL_SIZE) {
+            c->pool.count = 0;
+            for (size_t i = 0; i < COLUMNS_CACHE_SLOTS; ++i) c->slots[i].cached = false;
+        }
+        const Line *line = &e->lines.items[row];
+        slot->cached = true;
+        slot->row = row;
+        slot->begin = c->pool.count;
+        scan_delims(e->data.items + line->begin, line->end - line->begin, c->delim, &c->pool);
+        slot->count = c->pool.count - slot->begin;
+    }
+    *count = slot->count;
+    return c->pool.items + slot->begin;
+}
+
+// The rows [first_row, old_last_row] were replaced by the rows [first_row, new_last_row].
+// The delimiters are relative to the lines, so the rows below are still valid if they
+// didn't move.
+void editor_columns_update(Editor *e, size_t first_row, size_t old_last_row, size_t new_last_row)
+{
+    Columns *c = &e->columns;
+    if (!c->active) return;
+    size_t last_row = old_last_row == new_last_row ? old_last_row : SIZE_MAX;
+    for (size_t i = 0; i < COLUMNS_CACHE_SLOTS; ++i) {
+        if (first_row <= c->slots[i].row && c->slots[i].row <= last_row) c->slots[i].cached = false;
+    }
+}
+
+void anchor_node_apply(Anchor_Node *node, size_t assign, size_t add)
+{
+    if (assign != ANCHOR_NONE) {
+        node->max = assign + add;
+        node->assign = assign;
+        node->add = add;
+    } else {
+        node->max += add;
+        node->add += add;
+    }
+}
+
+void anchors_push(Anchors *a, size_t node)
+{
+    Anchor_Node *n = &a->nodes[node];
+    if (n->assign == ANCHOR_NONE && n->add == 0) return;
+    anchor_node_apply(&a->nodes[2*node], n->assign, n->add);
+    anchor_node_apply(&a->nodes[2*node + 1], n->assign, n->add);
+    n->assign = ANCHOR_NONE;
+    n->add = 0;
+}
+
+// Applies the update to the leaves [begin, end) under the node that covers [node_begin, node_end)
+void anchors_apply(Anchors *a, size_t node, size_t node_begin, size_t node_end, size_t begin, size_t end, size_t assign, size_t add)
+{
+    if (end <= node_begin || node_end <= begin) return;
+    if (begin <= node_begin && node_end <= end) {
+        anchor_node_apply(&a->nodes[node], assign, add);
+        return;
+    }
+    anchors_push(a, node);
+    size_t middle = node_begin + (node_end - node_begin)/2;
+    anchors_apply(a, 2*node, node_begin, middle, begin, end, assign, add);
+    anchors_apply(a, 2*node + 1, middle, node_end, begin, end, assign, add);
+    size_t left = a->nodes[2*node].max;
+    size_t right = a->nodes[2*node + 1].max;
+    a->nodes[node].max = left > right ? left : right;
+}
+
+// First leaf at or after the position. The unused leaves are at ANCHOR_NONE, so they
+// are never before the leaves in use.
+size_t anchors_lower_bound(Anchors *a, size_t position)
+{
+    if (a->count == 0) return 0;
+    size_t node = 1;
+    while (node < a->size) {
+        anchors_push(a, node);
+        node = a->nodes[2*node].max >= position ? 2*node : 2*node + 1;
+    }
+    size_t leaf = node - a->size;
+    return leaf < a->count && a->nodes[node].max >= position ? leaf : a->count;
+}
+
+size_t anchors_get(Anchors *a, size_t id)
+{
+    ASSERT(id < a->leaves.count && a->leaves.items[id] != ANCHOR_NONE, "anchor %zu was removed", id);
+    size_t leaf = a->leaves.items[id];
+    size_t node = 1;
+    for (size_t half = a->size/2; half > 0; half /= 2) {
+        anchors_push(a, node);
+        node = 2*node + ((leaf & half) != 0);
+    }
+    return a->nodes[node].max;
+}
+
+// Adding an anchor rebuilds the whole tree and drops the removed anchors. That happens
+// when the user puts a mark or jumps somewhere, unlike the edits that move them.
+size_t anchors_add(Anchors *a, size_t position)
+{
+    // Every position ends up in its leaf
+    for (size_t node = 1; node < a->size; ++node) anchors_push(a, node);
+
+    size_t id = 0;
+    while (id < a->leaves.count && a->leaves.items[id] != ANCHOR_NONE) id += 1;
+    if (id == a->leaves.count) da_append(&a->leaves, ANCHOR_NONE);
+
+    size_t count = 0;
+    for (size_t leaf = 0; leaf < a->count; ++leaf) {
+        if (a->ids[leaf] != ANCHOR_NONE) count += 1;
+    }
+    size_t size = 1;
+    while (size < count + 1) size *= 2;
+    Anchor_Node *nodes = malloc(2*size*sizeof(*nodes));
+    size_t *ids = malloc(size*sizeof(*ids));
+    ASSERT(nodes != NULL && ids != NULL, "Buy more RAM lol");
+
+    size_t n = 0;
+    bool added = false;
+    for (size_t leaf = 0; leaf <= a->count; ++leaf) {
+        size_t max = leaf < a->count ? a->nodes[a->size + leaf].max : ANCHOR_NONE;
+        if (!added && position <= max) {
+            nodes[size + n] = (Anchor_Node) { .max = position, .assign = ANCHOR_NONE };
+            ids[n] = id;
+            a->leaves.items[id] = n++;
+            added = true;
+        }
+        if (leaf == a->count || a->ids[leaf] == ANCHOR_NONE) continue;
+        nodes[size + n] = (Anchor_Node) { .max = max, .assign = ANCHOR_NONE };
+        ids[n] = a->ids[leaf];
+        a->leaves.items[ids[n]] = n;
+        n += 1;
+    }
+    for (size_t leaf = n; leaf < size; ++leaf) {
+        nodes[size + leaf] = (Anchor_Node) { .max = ANCHOR_NONE, .assign = ANCHOR_NONE };
+    }
+    for (size_t node = size; node-- > 1;) {
+        size_t left = nodes[2*node].max;
+        size_t right = nodes[2*node + 1].max;
+        nodes[node] = (Anchor_Node) { .max = left > right ? left : right, .assign = ANCHOR_NONE };
+    }
+
+    free(a->nodes);
+    free(a->ids);
+    a->nodes = nodes;
+    a->ids = ids;
+    a->size = size;
+    a->count = n;
+    return id;
+}
+
+// The leaf stays in the tree until the next rebuild, it just doesn't belong to anybody
+void anchors_remove(Anchors *a, size_t id)
+{
+    ASSERT(id < a->leaves.count && a->leaves.items[id] != ANCHOR_NONE, "anchor %zu was removed", id);
+    a->ids[a->leaves.items[id]] = ANCHOR_NONE;
+    a->leaves.items[id] = ANCHOR_NONE;
+}
+
+// The anchors inside the removed text collapse to its beginning and the ones after it
+// move with the text. The text inserted at an anchor goes after it.
+void anchors_update(Anchors *a, size_t offset, size_t remove_count, size_t insert_count)
+{
+    if (a->count == 0) return;
+    size_t first = anchors_lower_bound(a, offset + 1);
+    size_t last = anchors_lower_bound(a, offset + (remove_count > 0 ? remove_count : 1));
+    if (first < last) anchors_apply(a, 1, 0, a->size, first, last, offset, 0);
+    if (last < a->count && insert_count != remove_count) {
+        anchors_apply(a, 1, 0, a->size, last, a->count, ANCHOR_NONE, insert_count - remove_count);
+    }
+}
+
+// Every modification of e->data goes through here, so all the indices derived from
+// the data can be kept up to date incrementally.
+void editor_splice(Editor *e, size_t offset, size_t remove_count, const char *insert, size_t insert_count)
+{
+    ASSERT(offset + remove_count <= e->data.count, "offset: %zu, remove_count: %zu, size: %zu", offset, remove_count, e->data.count);
+
+    size_t first_row = editor_row_of(e, offset);
+    size_t old_last_row = editor_row_of(e, offset + remove_count);
+    size_t old_lines_count = e->lines.count;
+    size_t old_size = e->data.count;
+    editor_words_update(e, first_row, old_last_row, false);
+
+    size_t tail = e->data.count - offset - remove_count;
+    da_reserve(&e->data, e->data.count - remove_count + insert_count);
+    memmove(&e->data.items[offset + insert_count], &e->data.items[offset + remove_count], tail);
+    memcpy(&e->data.items[offset], insert, insert_count);
+    e->data.count = e->data.count - remove_count + insert_count;
+
+    editor_lines_update(e, first_row, old_last_row, old_size);
+
+    size_t new_last_row = old_last_row + e->lines.count - old_lines_count;
+    editor_filter_update(e, first_row, old_last_row, new_last_row);
+    editor_folds_update(e, first_row, old_last_row, new_last_row);
+    editor_brackets_update(e, first_row, old_last_row, new_last_row);
+    editor_columns_update(e, first_row, old_last_row, new_last_row);
+    editor_words_update(e, first_row, new_last_row, true);
+    anchors_update(&e->anchors, offset, remove_count, insert_count);
+    e->generation += 1;
+}
+
+void editor_insert_text(Editor *e, const char *text, size_t text_size)
+{
+    if (e->cursor > e->data.count) e->cursor = e->data.count;
+    editor_splice(e, e->cursor, 0, text, text_size);
+    e->cursor += text_size;
+}
+
+void editor_insert_char(Editor *e, char x)
+{
+    editor_insert_text(e, &x, 1);
+}
+
+void editor_delete_char(Editor *e)
+{
+    if (e->cursor < e->data.count) {
+        editor_splice(e, e->cursor, 1, NULL, 0);
+    }
+}
+
+void editor_backdelete_char(Editor *e)
+{
+    if (0 < e->cursor && e->cursor <= e->data.count) {
+        editor_splice(e, e->cursor - 1, 1, NULL, 0);
+        e->cursor -= 1;
+    }
+}
+
+// Replaces the word being completed with the candidate `index` (0 is the typed prefix)
+void editor_select_completion(Editor *e, size_t index)
+{
+    Completion *c = &e->completion;
+    size_t begin = index == 0 ? 0 : c->ends[index - 1];
+    size_t size = c->ends[index] - begin;
+    editor_splice(e, c->begin, c->size, c->text.items + begin, size);
+    c->size = size;
+    c->selected = index;
+    e->cursor = c->begin + size;
+}
+
+typedef struct {
+    const Words *words;
+    size_t index;
+    size_t count; // Occurrences in all the buffers
+} Completion_Candidate;
+
+// Completes the word before the cursor with the words of all the buffers. The top
+// candidates of each buffer are merged, summing up the counts of the same words.
+// `backwards` starts from the least frequent candidate.
+void editor_start_completion(Editor *e, Buffers *buffers, bool backwards)
+{
+    Completion *c = &e->completion;
+    if (e->cursor > e->data.count) e->cursor = e->data.count;
+    size_t begin = e->cursor;
+    size_t line_begin = e->lines.items[editor_current_line(e)].begin;
+    while (begin > line_begin && is_word_char(e->data.items[begin - 1])) begin -= 1;
+    if (begin == e->cursor) return;
+    const char *prefix = e->data.items + begin;
+    size_t prefix_size = e->cursor - begin;
+
+    Completion_Candidate top[COMPLETION_CANDIDATES];
+    size_t count = 0;
+    for (size_t i = 0; i < buffers->count; ++i) {
+        Editor *b = buffers->items[i];
+        if (b->pending) continue;
+        size_t found[COMPLETION_CANDIDATES];
+        size_t found_count = editor_complete_word(b, prefix, prefix_size, found, COMPLETION_CANDIDATES);
+        for (size_t j = 0; j < found_count; ++j) {
+            const Word *word = &b->words.items[found[j]];
+            size_t k = 0;
+            for (; k < count; ++k) {
+                const Word *other = &top[k].words->items[top[k].index];
+                if (word_compare(b->words.text.items + word->offset, word->size,
+                                 top[k].words->text.items + other->offset, other->size) == 0) break;
+            }
+            if (k < count) {
+                top[k].count += word->count;
+            } else if (count < COMPLETION_CANDIDATES) {
+                k = count++;
+                top[k] = (Completion_Candidate) { .words = &b->words, .index = found[j], .count = word->count };
+            } else if (top[count - 1].count < word->count) {
+                k = count - 1;
+                top[k] = (Completion_Candidate) { .words = &b->words, .index = found[j], .count = word->count };
+            } else {
+                continue;
+            }
+            for (; k > 0 && top[k - 1].count < top[k].count; --k) {
+                Completion_Candidate x = top[k - 1];
+                top[k - 1] = top[k];
+                top[k] = x;
+            }
+        }
+    }
+    if (count == 0) {
+        editor_set_status(e, "No completions");
+        return;
+    }
+
+    c->text.count = 0;
+    da_append_many(&c->text, prefix, prefix_size);
+    c->ends[0] = c->text.count;
+    for (size_t i = 0; i < count; ++i) {
+        const Word *word = &top[i].words->items[top[i].index];
+        da_append_many(&c->text, top[i].words->text.items + word->offset, word->size);
+        c->ends[i + 1] = c->text.count;
+    }
+    c->active = true;
+    c->begin = begin;
+    c->size = e->cursor - begin;
+    c->count = count;
+    editor_select_completion(e, backwards ? count : 1);
+}
+
+typedef struct {
+    const Editor *e;
+    Rows results[MAX_WORKERS];
+} Filter_Job;
+
+void filter_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    Filter_Job *job = ctx;
+    const Filter *f = &job->e->filter;
+    for (size_t row = begin; row < end; ++row) {
+        if (editor_line_contains(job->e, row, f->pattern.items, f->pattern.count)) {
+            da_append(&job->results[worker], row);
+        }
+    }
+}
+
+// Shows only the lines that contain the pattern. Empty pattern disables the filter.
+// The lines are matched in parallel, each worker collecting the matching rows of its
+// chunk of lines, and the chunks are then concatenated in order.
+void editor_filter(Editor *e, const char *pattern, size_t pattern_size)
+{
+    Filter *f = &e->filter;
+    f->active = false;
+    f->rows.count = 0;
+    f->pattern.count = 0;
+    if (pattern_size == 0) return;
+    da_append_many(&f->pattern, pattern, pattern_size);
+
+    Filter_Job job = { .e = e };
+    size_t workers = parallel_for(e->lines.count, 64*1024, &job, filter_job);
+    for (size_t i = 0; i < workers; ++i) {
+        da_append_many(&f->rows, job.results[i].items, job.results[i].count);
+        free(job.results[i].items);
+    }
+    f->active = true;
+}
+
+bool editor_row_visible(const Editor *e, size_t row)
+{
+    if (editor_fold_hiding(e, row)) return false;
+    if (!e->filter.active) return true;
+    if (row == editor_current_line(e)) return true;
+    size_t i = rows_lower_bound(&e->filter.rows, row);
+    return i < e->filter.rows.count && e->filter.rows.items[i] == row;
+}
+
+// Next row after `row` that is not filtered out. The row with the cursor is never
+// filtered out, even if the filter does not match it. Otherwise editing a matching
+// line so it does not match anymore would make the cursor disappear.
+bool editor_next_unfiltered_row(const Editor *e, size_t row, size_t *next)
+{
+    if (!e->filter.active) {
+        if (row + 1 >= e->lines.count) return false;
+        *next = row + 1;
+        return true;
+    }
+
+    size_t cursor_row = editor_current_line(e);
+    size_t i = rows_lower_bound(&e->filter.rows, row + 1);
+    size_t candidate = i < e->filter.rows.count ? e->filter.rows.items[i] : SIZE_MAX;
+    if (row < cursor_row && cursor_row < candidate) candidate = cursor_row;
+    if (candidate == SIZE_MAX) return false;
+    *next = candidate;
+    return true;
+}
+
+bool editor_prev_unfiltered_row(const Editor *e, size_t row, size_t *prev)
+{
+    if (!e->filter.active) {
+        if (row == 0) return false;
+        *prev = row - 1;
+        return true;
+    }
+
+    size_t cursor_row = editor_current_line(e);
+    size_t i = rows_lower_bound(&e->filter.rows, row);
+    bool found = i > 0;
+    size_t candidate = found ? e->filter.rows.items[i - 1] : 0;
+    if (cursor_row < row && (!found || candidate < cursor_row)) {
+        candidate = cursor_row;
+        found = true;
+    }
+    if (found) *prev = candidate;
+    return found;
+}
+
+// Folded rows are jumped over with a single lookup per fold, no matter how many
+// rows they hide.
+bool editor_next_visible_row(const Editor *e, size_t row, size_t *next)
+{
+    size_t candidate;
+    for (;;) {
+        if (!editor_next_unfiltered_row(e, row, &candidate)) return false;
+        const Fold *fold = editor_fold_hiding(e, candidate);
+        if (fold == NULL) break;
+        row = fold->last;
+    }
+    *next = candidate;
+    return true;
+}
+
+bool editor_prev_visible_row(const Editor *e, size_t row, size_t *prev)
+{
+    size_t candidate;
+    for (;;) {
+        if (!editor_prev_unfiltered_row(e, row, &candidate)) return false;
+        const Fold *fold = editor_fold_hiding(e, candidate);
+        if (fold == NULL) break;
+        row = fold->first + 1;
+    }
+    *prev = candidate;
+    return true;
+}
+
+void editor_fold(Editor *e, Fold fold)
+{
+    // Folds inside of the new one are swallowed by it
+    size_t i = 0;
+    while (i < e->folds.count && e->folds.items[i].last < fold.first) i += 1;
+    size_t j = i;
+    while (j < e->folds.count && e->folds.items[j].first <= fold.last) {
+        if (e->folds.items[j].first < fold.first) fold.first = e->folds.items[j].first;
+        if (e->folds.items[j].last > fold.last) fold.last = e->folds.items[j].last;
+        j += 1;
+    }
+
+    if (j == i) {
+        da_append(&e->folds, fold);
+        memmove(&e->folds.items[i + 1], &e->folds.items[i], (e->folds.count - 1 - i)*sizeof(fold));
+    } else {
+        memmove(&e->folds.items[i + 1], &e->folds.items[j], (e->folds.count - j)*sizeof(fold));
+        e->folds.count -= j - i - 1;
+    }
+    e->folds.items[i] = fold;
+}
+
+void editor_unfold(Editor *e, const Fold *fold)
+{
+    size_t i = fold - e->folds.items;
+    memmove(&e->folds.items[i], &e->folds.items[i + 1], (e->folds.count - i - 1)*sizeof(*fold));
+    e->folds.count -= 1;
+}
+
+bool editor_line_is_blank(const Editor *e, size_t row)
+{
+    const Line *line = &e->lines.items[row];
+    for (size_t i = line->begin; i < line->end; ++i) {
+        if (!isspace(e->data.items[i])) return false;
+    }
+    return true;
+}
+
+size_t editor_line_indent(const Editor *e, size_t row)
+{
+    const Line *line = &e->lines.items[row];
+    size_t i = line->begin;
+    while (i < line->end && (e->data.items[i] == ' ' || e->data.items[i] == '\t')) i += 1;
+    return editor_visual_col(e, row, i);
+}
+
+// Row of the brace that closes the last unclosed `{` of the row
+bool editor_find_closing_brace_row(Editor *e, size_t row, size_t *result)
+{
+    const Line *line = &e->lines.items[row];
+    size_t open = 0;
+    size_t depth = 0;
+    for (size_t i = line->begin; i < line->end; ++i) {
+        if (e->data.items[i] == '{') {
+            if (depth == 0) open = i;
+            depth += 1;
+        } else if (e->data.items[i] == '}' && depth > 0) {
+            depth -= 1;
+        }
+    }
+    if (depth == 0) return false;
+
+    size_t close;
+    if (!editor_find_matching_bracket(e, open, &close)) return false;
+    *result = editor_row_of(e, close);
+    return true;
+}
+
+// Descriptor of a line that is sorted instead of the line itself
+typedef struct {
+    // First 16 bytes of the line in the big-endian order, so they compare like the bytes.
+    // Most of the comparisons don't need to look at the data.
+    uint64_t prefix[2];
+    size_t begin;
+    size_t size;
+} Sort_Line;
+
+typedef struct {
+    const Editor *e;
+    Sort_Line *items;
+    Sort_Line *scratch;
+    size_t bounds[MAX_WORKERS + 1]; // Sorted runs between them
+    size_t runs;
+} Sort_Job;
+
+static inline bool sort_line_less(const char *data, const Sort_Line *x, const Sort_Line *y)
+{
+    if (x->prefix[0] != y->prefix[0]) return x->prefix[0] < y->prefix[0];
+    if (x->prefix[1] != y->prefix[1]) return x->prefix[1] < y->prefix[1];
+    if (x->size <= 16 || y->size <= 16) return x->size < y->size;
+    size_t n = x->size < y->size ? x->size : y->size;
+    int cmp = memcmp(data + x->begin + 16, data + y->begin + 16, n - 16);
+    return cmp < 0 || (cmp == 0 && x->size < y->size);
+}
+
+void sort_lines_merge(const char *data, const Sort_Line *a, size_t a_count, const Sort_Line *b, size_t b_count, Sort_Line *out)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a_count && j < b_count) {
+        if (sort_line_less(data, &b[j], &a[i])) {
+            *out++ = b[j++];
+        } else {
+            *out++ = a[i++];
+        }
+    }
+    memcpy(out, a + i, (a_count - i)*sizeof(*a));
+    memcpy(out + (a_count - i), b + j, (b_count - j)*sizeof(*b));
+}
+
+// Stable merge sort of the items with the scratch of the same size. The sorted items
+// end up in the items.
+void sort_lines_range(const char *data, Sort_Line *items, Sort_Line *scratch, size_t count)
+{
+    if (count <= 16) {
+        for (size_t i = 1; i < count; ++i) {
+            Sort_Line x = items[i];
+            size_t j = i;
+            while (j > 0 && sort_line_less(data, &x, &items[j - 1])) {
+                items[j] = items[j - 1];
+                j -= 1;
+            }
+            items[j] = x;
+        }
+        return;
+    }
+    size_t half = count/2;
+    sort_lines_range(data, items, scratch, half);
+    sort_lines_range(data, items + half, scratch + half, count - half);
+    if (!sort_line_less(data, &items[half], &items[half - 1])) return;
+    memcpy(scratch, items, count*sizeof(*items));
+    sort_lines_merge(data, scratch, half, scratch + half, count - half, items);
+}
+
+void sort_lines_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    Sort_Job *job = ctx;
+    const Editor *e = job->e;
+    for (size_t row = begin; row < end; ++row) {
+        const Line *line = &e->lines.items[row];
+        size_t size = line->end - line->begin;
+        Sort_Line *x = &job->items[row];
+        *x = (Sort_Line) { .begin = line->begin, .size = size };
+        for (size_t i = 0; i < 16; ++i) {
+            x->prefix[i/8] = x->prefix[i/8] << 8 | (i < size ? (uint8_t) e->data.items[line->begin + i] : 0);
+        }
+    }
+    sort_lines_range(e->data.items, job->items + begin, job->scratch + begin, end - begin);
+    // The neighbour writes the beginning of the run, and the first one begins at 0
+    job->bounds[worker + 1] = end;
+}
+
+// Merges the runs 2*i and 2*i + 1 from the items into the scratch for each i in [begin, end)
+void sort_merge_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    UNUSED(worker);
+    Sort_Job *job = ctx;
+    for (size_t pair = begin; pair < end; ++pair) {
+        size_t first = job->bounds[2*pair];
+        size_t middle = job->bounds[2*pair + 1];
+        size_t last = job->bounds[2*pair + 2];
+        sort_lines_merge(job->e->data.items,
+                         job->items + first, middle - first,
+                         job->items + middle, last - middle,
+                         job->scratch + first);
+    }
+}
+
+// Replaces the text of the buffer with the given lines in one splice. The buffer keeps
+// ending with the newline if it did.
+void editor_replace_lines(Editor *e, const Sort_Line *lines, size_t count)
+{
+    const Line *last = &e->lines.items[e->lines.count - 1];
+    bool trailing_newline = last->begin == last->end && e->data.count > 0;
+    size_t row = editor_current_line(e);
+
+    Data out = {0};
+    da_reserve(&out, e->data.count + 1);
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(out.items + out.count, e->data.items + lines[i].begin, lines[i].size);
+        out.count += lines[i].size;
+        if (i + 1 < count || trailing_newline) out.items[out.count++] = '\n';
+    }
+    editor_splice(e, 0, e->data.count, out.items, out.count);
+    free(out.items);
+
+    if (row >= e->lines.count) row = e->lines.count - 1;
+    e->cursor = e->lines.items[row].begin;
+}
+
+// Each worker sorts its chunk of the lines, then the sorted chunks are merged in pairs
+// in parallel until there is one. Only the descriptors of the lines are moved around,
+// the text is copied once when the buffer is rebuilt.
+void editor_sort_lines(Editor *e)
+{
+    size_t count = editor_file_lines_count(e);
+    Sort_Job job = { .e = e };
+    job.items = malloc(count*sizeof(*job.items));
+    job.scratch = malloc(count*sizeof(*job.scratch));
+    ASSERT((job.items != NULL && job.scratch != NULL) || count == 0, "Buy more RAM lol");
+    job.runs = parallel_for(count, 64*1024, &job, sort_lines_job);
+
+    while (job.runs > 1) {
+        size_t pairs = job.runs/2;
+        parallel_for(pairs, 1, &job, sort_merge_job);
+        if (job.runs%2 == 1) {
+            size_t first = job.bounds[job.runs - 1];
+            memcpy(job.scratch + first, job.items + first, (job.bounds[job.runs] - first)*sizeof(*job.items));
+        }
+        size_t runs = (job.runs + 1)/2;
+        for (size_t i = 0; i <= runs; ++i) {
+            job.bounds[i] = job.bounds[2*i < job.runs ? 2*i : job.runs];
+        }
+        job.runs = runs;
+        Sort_Line *items = job.items;
+        job.items = job.scratch;
+        job.scratch = items;
+    }
+
+    editor_replace_lines(e, job.items, count);
+    free(job.items);
+    free(job.scratch);
+    editor_set_status(e, "Sorted %zu lines", count);
+}
+
+// Deletes the lines that are the same as the line before them
+void editor_uniq_lines(Editor *e)
+{
+    size_t count = editor_file_lines_count(e);
+    Sort_Line *lines = malloc(count*sizeof(*lines));
+    ASSERT(lines != NULL || count == 0, "Buy more RAM lol");
+    size_t n = 0;
+    for (size_t row = 0; row < count; ++row) {
+        const Line *line = &e->lines.items[row];
+        size_t size = line->end - line->begin;
+        if (n > 0 && lines[n - 1].size == size &&
+            memcmp(e->data.items + lines[n - 1].begin, e->data.items + line->begin, size) == 0) continue;
+        lines[n++] = (Sort_Line) { .begin = line->begin, .size = size };
+    }
+    if (n < count) editor_replace_lines(e, lines, n);
+    free(lines);
+    editor_set_status(e, "Deleted %zu repeated lines", count - n);
+}
+
+typedef struct {
+    size_t bytes;
+    size_t lines;
+    size_t words;
+    size_t chars;   // UTF-8 characters, the continuation bytes are not counted
+    size_t longest; // In characters without the newline
+    size_t blank;   // Empty or only whitespace
+    size_t crs;
+} Stats;
+
+typedef struct {
+    const Editor *e;
+    Stats results[MAX_WORKERS];
+} Stats_Job;
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH 0x8080808080808080ULL
+
+// High bits of the bytes of x that are equal to c
+uint64_t swar_eq(uint64_t x, uint8_t c)
+{
+    x ^= SWAR_ONES*c;
+    return ~(((x & ~SWAR_HIGH) + ~SWAR_HIGH) | x) & SWAR_HIGH;
+}
+
+// Works on 8 bytes at a time: every property of a byte becomes its high bit in a mask,
+// so the counts are popcounts and the line ends are found with ctz.
+void stats_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    Stats_Job *job = ctx;
+    const Editor *e = job->e;
+    Stats *s = &job->results[worker];
+    if (begin >= end) return;
+
+    // The chunk starts at the beginning of a line and ends after a newline or at the end
+    // of the data, so the words and the lines never cross the chunks
+    size_t chunk_begin = e->lines.items[begin].begin;
+    size_t chunk_end = end < e->lines.count ? e->lines.items[end].begin : e->data.count;
+    const char *data = e->data.items;
+    s->bytes = chunk_end - chunk_begin;
+    if (s->bytes == 0) return;
+
+    uint64_t prev_space = SWAR_HIGH >> 56; // What precedes the byte 0 of the next word
+    size_t line_start_chars = 0;
+    bool line_has_text = false;
+    for (size_t base = chunk_begin; base < chunk_end; base += 8) {
+        uint64_t w = 0x2020202020202020ULL;
+        size_t n = chunk_end - base < 8 ? chunk_end - base : 8;
+        memcpy(&w, data + base, n);
+        uint64_t valid = n == 8 ? SWAR_HIGH : SWAR_HIGH & ((1ULL << 8*n) - 1);
+
+        // '\t', '\n', '\v', '\f' and '\r' are the bytes from 9 to 13
+        uint64_t low = w & ~SWAR_HIGH;
+        uint64_t control = (low + SWAR_ONES*(0x80 - 9)) & ~(low + SWAR_ONES*(0x80 - 14)) & ~w & SWAR_HIGH;
+        uint64_t space = control | swar_eq(w, ' ');
+        uint64_t newline = swar_eq(w, '\n') & valid;
+        uint64_t chars = ~(w & ~(w << 1)) & valid;
+        uint64_t text = ~space & valid;
+
+        s->crs += __builtin_popcountll(swar_eq(w, '\r') & valid);
+        s->words += __builtin_popcountll(text & (space << 8 | prev_space));
+        prev_space = space >> 56;
+
+        while (newline) {
+            uint64_t below = (newline & -newline) - 1;
+            size_t length = s->chars + __builtin_popcountll(chars & below) - line_start_chars;
+            if (length > s->longest) s->longest = length;
+            if (!line_has_text && (text & below) == 0) s->blank += 1;
+            s->lines += 1;
+            line_start_chars = s->chars + __builtin_popcountll(chars & below) + 1;
+            line_has_text = false;
+            text &= ~below;
+            newline &= newline - 1;
+        }
+        line_has_text = line_has_text || text != 0;
+        s->chars += __builtin_popcountll(chars);
+    }
+
+    // The last line of the file without the newline
+    if (data[chunk_end - 1] != '\n') {
+        size_t length = s->chars - line_start_chars;
+        if (length > s->longest) s->longest = length;
+        if (!line_has_text) s->blank += 1;
+        s->lines += 1;
+    }
+}
+
+// The same counts as wc in one pass over the data, the chunks of lines are counted in
+// parallel.
+void editor_show_stats(Editor *e)
+{
+    Stats_Job job = { .e = e };
+    size_t workers = parallel_for(e->lines.count, 64*1024, &job, stats_job);
+    Stats total = {0};
+    for (size_t i = 0; i < workers; ++i) {
+        const Stats *s = &job.results[i];
+        total.bytes += s->bytes;
+        total.lines += s->lines;
+        total.words += s->words;
+        total.chars += s->chars;
+        total.blank += s->blank;
+        total.crs += s->crs;
+        if (s->longest > total.longest) total.longest = s->longest;
+    }
+    editor_set_status(e, "%zu bytes, %zu lines, %zu words, %zu chars, longest line %zu, %zu blank, %zu CR",
+                      total.bytes, total.lines, total.words, total.chars, total.longest, total.blank, total.crs);
+}
+
+bool editor_is_json(const Editor *e)
+{
+    if (e->file_path == NULL || e->scratch) return false;
+    const char *ext = strrchr(e->file_path, '.');
+    return ext != NULL && strcmp(ext, ".json") == 0;
+}
+
+#define JSON_QUOTE      1
+#define JSON_BACKSLASH  2
+#define JSON_STRUCTURAL 4
+
+static uint8_t json_classes[256] = {
+    ['"'] = JSON_QUOTE,
+    ['\\'] = JSON_BACKSLASH,
+    ['{'] = JSON_STRUCTURAL, ['}'] = JSON_STRUCTURAL,
+    ['['] = JSON_STRUCTURAL, [']'] = JSON_STRUCTURAL,
+    [','] = JSON_STRUCTURAL, [':'] = JSON_STRUCTURAL,
+};
+
+// Bits of the characters that are escaped by an odd sequence of backslashes. The carry
+// into the next block is kept in `prev_escaped`. The trick is from simdjson.
+uint64_t json_find_escaped(uint64_t backslash, uint64_t *prev_escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~*prev_escaped;
+    uint64_t follows_escape = backslash << 1 | *prev_escaped;
+    uint64_t odd_sequence_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t sequences_starting_on_even_bits;
+    *prev_escaped = __builtin_add_overflow(odd_sequence_starts, backslash, &sequences_starting_on_even_bits);
+    uint64_t invert_mask = sequences_starting_on_even_bits << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+// Each bit becomes the XOR of itself and all the bits below it
+uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+void json_index_append(Json_Index *j, size_t offset)
+{
+    if (j->count >= j->capacity) {
+        j->capacity = j->capacity == 0 ? ITEMS_INIT_CAPACITY : j->capacity*2;
+        j->offsets = realloc(j->offsets, j->capacity*sizeof(*j->offsets));
+        ASSERT(j->offsets != NULL, "Buy more RAM lol");
+        j->links = realloc(j->links, j->capacity*sizeof(*j->links));
+        ASSERT(j->links != NULL, "Buy more RAM lol");
+    }
+    j->offsets[j->count++] = offset;
+}
+
+// Stage 1 finds the structural characters 64 bytes at a time with bitmasks: the quotes
+// that are not escaped open and close the strings, and everything between them is masked
+// out. Stage 2 links the brackets with a stack.
+void json_index_build(Json_Index *j, const char *data, size_t size)
+{
+    j->count = 0;
+    j->error = SIZE_MAX;
+
+    uint64_t prev_escaped = 0;
+    uint64_t prev_in_string = 0;
+    for (size_t base = 0; base < size; base += 64) {
+        char block[64];
+        size_t n = size - base < 64 ? size - base : 64;
+        memcpy(block, data + base, n);
+        memset(block + n, ' ', 64 - n);
+
+        uint64_t quote = 0, backslash = 0, structural = 0;
+        for (size_t i = 0; i < 64; ++i) {
+            uint8_t class = json_classes[(uint8_t) block[i]];
+            quote      |= (uint64_t) (class & JSON_QUOTE) << i;
+            backslash  |= (uint64_t) ((class & JSON_BACKSLASH) >> 1) << i;
+            structural |= (uint64_t) ((class & JSON_STRUCTURAL) >> 2) << i;
+        }
+
+        quote &= ~json_find_escaped(backslash, &prev_escaped);
+        uint64_t in_string = prefix_xor(quote) ^ prev_in_string;
+        prev_in_string = (uint64_t) ((int64_t) in_string >> 63);
+        structural &= ~in_string;
+
+        while (structural) {
+            json_index_append(j, base + __builtin_ctzll(structural));
+            structural &= structural - 1;
+        }
+    }
+    ASSERT(j->count < JSON_NONE, "Too many structural characters for 32-bit links");
+
+    Offsets stack = {0};
+    for (size_t i = 0; i < j->count; ++i) {
+        char x = data[j->offsets[i]];
+        if (x == '{' || x == '[') {
+            da_append(&stack, i);
+        } else if (x == '}' || x == ']') {
+            if (stack.count == 0 || data[j->offsets[stack.items[stack.count - 1]]] != (x == '}' ? '{' : '[')) {
+                j->error = j->offsets[i];
+                break;
+            }
+            size_t open = stack.items[--stack.count];
+            j->links[open] = i;
+            j->links[i] = open;
+        } else {
+            j->links[i] = stack.count > 0 ? stack.items[stack.count - 1] : JSON_NONE;
+        }
+    }
+    if (j->error == SIZE_MAX && stack.count > 0) j->error = j->offsets[stack.items[stack.count - 1]];
+    free(stack.items);
+}
+
+bool editor_json_ready(Editor *e)
+{
+    if (!editor_is_json(e)) return false;
+    if (!e->json.built || e->json.generation != e->generation) {
+        editor_set_status(e, "Building the JSON index...");
+        return false;
+    }
+    if (e->json.error != SIZE_MAX) {
+        editor_set_status(e, "The brackets of the JSON don't match at line %zu", editor_row_of(e, e->json.error) + 1);
+        return false;
+    }
+    return true;
+}
+
+char json_char(const Editor *e, size_t i)
+{
+    return e->data.items[e->json.offsets[i]];
+}
+
+bool json_is_open(char x)
+{
+    return x == '{' || x == '[';
+}
+
+bool json_is_close(char x)
+{
+    return x == '}' || x == ']';
+}
+
+// Amount of the structural characters before the offset
+size_t json_lower_bound(const Editor *e, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = e->json.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (e->json.offsets[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Opening bracket of the container of the structural `i`
+uint32_t json_parent(const Editor *e, size_t i)
+{
+    char x = json_char(e, i);
+    if (x == ',' || x == ':') return e->json.links[i];
+    if (json_is_close(x)) i = e->json.links[i];
+    // A value can only follow the opening bracket of its container, or a , or : in it
+    if (i == 0) return JSON_NONE;
+    char prev = json_char(e, i - 1);
+    if (json_is_open(prev)) return i - 1;
+    if (prev == ',' || prev == ':') return e->json.links[i - 1];
+    return JSON_NONE;
+}
+
+// Opening bracket of the innermost container around the offset. The brackets of a
+// container are not inside of it.
+uint32_t json_enclosing(const Editor *e, size_t offset)
+{
+    size_t i = json_lower_bound(e, offset + 1);
+    if (i == 0) return JSON_NONE;
+    i -= 1;
+    char x = json_char(e, i);
+    if (json_is_open(x) && e->json.offsets[i] < offset) return i;
+    return json_parent(e, i);
+}
+
+void editor_move_json_parent(Editor *e)
+{
+    if (!editor_json_ready(e)) return;
+    uint32_t parent = json_enclosing(e, e->cursor);
+    if (parent != JSON_NONE) e->cursor = e->json.offsets[parent];
+}
+
+void editor_move_after_json_separator(Editor *e, size_t i)
+{
+    size_t offset = e->json.offsets[i] + 1;
+    while (offset < e->data.count && isspace(e->data.items[offset])) offset += 1;
+    e->cursor = offset;
+}
+
+// Moves to the beginning of the next element of the container
+void editor_move_json_next_sibling(Editor *e)
+{
+    if (!editor_json_ready(e)) return;
+    size_t i = json_lower_bound(e, e->cursor);
+    while (i < e->json.count) {
+        char x = json_char(e, i);
+        if (json_is_open(x)) {
+            // Nested containers are skipped at once
+            i = e->json.links[i] + 1;
+        } else if (x == ',') {
+            editor_move_after_json_separator(e, i);
+            return;
+        } else if (json_is_close(x)) {
+            return;
+        } else {
+            i += 1;
+        }
+    }
+}
+
+// Moves to the beginning of the previous element of the container
+void editor_move_json_prev_sibling(Editor *e)
+{
+    if (!editor_json_ready(e)) return;
+    size_t i = json_lower_bound(e, e->cursor);
+    size_t commas = 0;
+    while (i > 0) {
+        i -= 1;
+        char x = json_char(e, i);
+        if (json_is_close(x)) {
+            i = e->json.links[i];
+        } else if (x == ',') {
+            commas += 1;
+            if (commas == 2) {
+                editor_move_after_json_separator(e, i);
+                return;
+            }
+        } else if (json_is_open(x)) {
+            if (commas == 1) editor_move_after_json_separator(e, i);
+            return;
+        }
+    }
+}
+
+// Folds the innermost object or array under the cursor that spans several rows
+bool editor_fold_json(Editor *e)
+{
+    if (!editor_json_ready(e)) return false;
+    size_t i = json_lower_bound(e, e->cursor);
+    uint32_t container = i < e->json.count && e->json.offsets[i] == e->cursor && json_is_open(json_char(e, i))
+        ? (uint32_t) i
+        : json_enclosing(e, e->cursor);
+    while (container != JSON_NONE) {
+        size_t first = editor_row_of(e, e->json.offsets[container]);
+        size_t last = editor_row_of(e, e->json.offsets[e->json.links[container]]);
+        if (first < last) {
+            editor_fold(e, (Fold) { .first = first, .last = last });
+            e->cursor = e->json.offsets[container];
+            return true;
+        }
+        container = json_parent(e, container);
+    }
+    editor_set_status(e, "Nothing to fold");
+    return true;
+}
+
+// Folds the block that starts at the cursor row: up to the brace closing the brace
+// opened on the row, or otherwise all the following rows indented deeper than it.
+// If the cursor row already represents a fold, unfolds it instead.
+void editor_toggle_fold(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    const Fold *fold = editor_fold_at(e, row);
+    if (fold) {
+        editor_unfold(e, fold);
+        return;
+    }
+    if (editor_is_json(e) && editor_fold_json(e)) return;
+
+    size_t last = row;
+    if (!editor_find_closing_brace_row(e, row, &last)) {
+        size_t indent = editor_line_indent(e, row);
+        for (size_t next = row + 1; next < e->lines.count; ++next) {
+            if (editor_line_is_blank(e, next)) continue;
+            if (editor_line_indent(e, next) <= indent) break;
+            last = next;
+        }
+    }
+
+    if (last == row) {
+        editor_set_status(e, "Nothing to fold");
+        return;
+    }
+    editor_fold(e, (Fold) { .first = row, .last = last });
+}
+
+// Picks the delimiter by the extension of the file, or the most frequent candidate on the
+// first line
+void editor_toggle_columns(Editor *e)
+{
+    Columns *c = &e->columns;
+    if (c->active) {
+        c->active = false;
+        return;
+    }
+
+    const char *ext = e->file_path ? strrchr(e->file_path, '.') : NULL;
+    char delim = 0;
+    if (ext && strcmp(ext, ".tsv") == 0) {
+        delim = '\t';
+    } else if (ext && strcmp(ext, ".csv") == 0) {
+        delim = ',';
+    } else {
+        const char *candidates = ",\t;|";
+        const Line *line = &e->lines.items[0];
+        size_t best = 0;
+        for (const char *x = candidates; *x != '\0'; ++x) {
+            size_t n = 0;
+            for (size_t i = line->begin; i < line->end; ++i) n += e->data.items[i] == *x;
+            if (n > best) {
+                best = n;
+                delim = *x;
+            }
+        }
+        if (delim == 0) {
+            editor_set_status(e, "The first line has no delimiters");
+            return;
+        }
+    }
+
+    c->active = true;
+    c->delim = delim;
+    c->pool.count = 0;
+    for (size_t i = 0; i < COLUMNS_CACHE_SLOTS; ++i) c->slots[i].cached = false;
+    editor_set_status(e, "Columns separated by `%s`", delim == '\t' ? "\\t" : (char[]) {delim, '\0'});
+}
+
+typedef enum {
+    STYLE_DEFAULT = 0,
+    STYLE_TILDE,  // `~` markers of the rows past the end of the buffer
+    STYLE_STATUS, // Labels on the status row
+    STYLE_MATCH,  // Partner of the bracket under the cursor
+    STYLE_POPUP,
+    STYLE_POPUP_SELECTED,
+    STYLE_GIT_ADDED,
+    STYLE_GIT_MODIFIED,
+    STYLE_GIT_DELETED,
+    COUNT_STYLES,
+} Style;
+
+typedef struct {
+    bool has_fg;
+    uint8_t fg[3]; // RGB, downsampled by the output encoder when the terminal can't do truecolor
+    bool has_bg;
+    uint8_t bg[3];
+    bool bold;
+} Style_Def;
+
+static const Style_Def style_defs[COUNT_STYLES] = {
+    [STYLE_DEFAULT] = {0},
+    [STYLE_TILDE]   = { .has_fg = true, .fg = {0x55, 0x77, 0xDD} },
+    [STYLE_STATUS]  = { .bold = true },
+    [STYLE_MATCH]   = { .has_bg = true, .bg = {0x00, 0x87, 0x87}, .bold = true },
+    [STYLE_POPUP]   = { .has_fg = true, .fg = {0xDD, 0xDD, 0xDD}, .has_bg = true, .bg = {0x44, 0x44, 0x44} },
+    [STYLE_POPUP_SELECTED] = { .has_fg = true, .fg = {0xDD, 0xDD, 0xDD}, .has_bg = true, .bg = {0x55, 0x77, 0xDD}, .bold = true },
+    [STYLE_GIT_ADDED]    = { .has_fg = true, .fg = {0x55, 0xBB, 0x55} },
+    [STYLE_GIT_MODIFIED] = { .has_fg = true, .fg = {0xDD, 0xAA, 0x33} },
+    [STYLE_GIT_DELETED]  = { .has_fg = true, .fg = {0xDD, 0x55, 0x55} },
+};
+
+typedef struct {
+    char *chars;
+    uint8_t *styles; // Style of each cell in chars
+    size_t *ends;    // Each row is blank with STYLE_DEFAULT starting from this column
+    size_t cursor_row, cursor_col;
+    size_t rows, cols;
+    // Allocated sizes of the buffers above, so resizing within them does not reallocate
+    size_t cells_capacity;
+    size_t rows_capacity;
+    Data out; // Encoded frame, kept around so we don't reallocate it on each flush
+
+    // What the terminal currently shows, so display_flush() can send only the difference
+    bool has_prev_frame;
+    char *prev_chars;
+    uint8_t *prev_styles;
+    size_t prev_cursor_row, prev_cursor_col;
+} Display;
+
+typedef struct {
+    size_t frames;
+    size_t full_frames;
+    size_t bytes_sent; // What display_flush() actually wrote to the terminal
+    size_t bytes_raw;  // Size of the raw grids of all the flushed frames
+    size_t resize_signals;
+    size_t resizes;    // Actually applied resizes after debouncing the signals
+} Profiler;
+
+static Profiler profiler = {0};
+
+void profiler_report(FILE *stream)
+{
+    fprintf(stream, "Frames:      %zu (%zu full)\n", profiler.frames, profiler.full_frames);
+    fprintf(stream, "Resizes:     %zu (%zu signals)\n", profiler.resizes, profiler.resize_signals);
+    fprintf(stream, "Bytes sent:  %zu\n", profiler.bytes_sent);
+    fprintf(stream, "Bytes raw:   %zu\n", profiler.bytes_raw);
+    if (profiler.bytes_raw > 0 && profiler.bytes_sent <= profiler.bytes_raw) {
+        fprintf(stream, "Bytes saved: %zu (%.1f%%)\n",
+                profiler.bytes_raw - profiler.bytes_sent,
+                100.0*(profiler.bytes_raw - profiler.bytes_sent)/profiler.bytes_raw);
+    }
+}
+
+// Scrolls the view vertically the least amount so the row is one of the first
+// `rows` visible rows of the view.
+void editor_scroll_to_row(Editor *e, size_t row, size_t rows)
+{
+    size_t top = e->view_row;
+    if (top >= e->lines.count) top = e->lines.count - 1;
+    if (!editor_row_visible(e, top) && !editor_next_visible_row(e, top, &top)) top = row;
+
+    if (row < top) {
+        top = row;
+    } else {
+        size_t visible = top;
+        for (size_t i = 1; i < rows && visible < row; ++i) {
+            if (!editor_next_visible_row(e, visible, &visible)) break;
+        }
+        if (visible != row) {
+            // The row is below the view. Make it the last row of the view.
+            top = row;
+            for (size_t i = 1; i < rows; ++i) {
+                if (!editor_prev_visible_row(e, top, &top)) break;
+            }
+        }
+    }
+
+    e->view_row = top;
+}
+
+// Amount of visible rows in [from, to]. Both rows are expected to be visible.
+size_t editor_count_visible_rows(const Editor *e, size_t from, size_t to)
+{
+    size_t count = 1;
+    while (from < to && editor_next_visible_row(e, from, &from)) count += 1;
+    return count;
+}
+
+// Renders the visible part of the line `row` that contains tabs into `dst`, expanding
+// the tabs into spaces up to the next tab stop. Instead of walking the line from
+// its beginning, the first visible character is found by binary searching the
+// cached visual columns of the tabs. Returns the amount of rendered cells.
+size_t editor_render_line_with_tabs(const Editor *e, size_t row, char *dst, size_t cols)
+{
+    const Line *line = &e->lines.items[row];
+    size_t view_col = e->view_col;
+
+    // Find the first tab that ends after view_col
+    size_t lo = line->tabs_begin;
+    size_t hi = line->tabs_end;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (e->tabs.items[mid].col <= view_col) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const Tab *prev = lo > line->tabs_begin ? &e->tabs.items[lo - 1] : NULL;
+    size_t prev_end_offset = prev ? prev->offset + 1 : line->begin;
+    size_t prev_end_col = prev ? prev->col : 0;
+
+    size_t offset, col;
+    size_t n = 0;
+    if (lo < line->tabs_end && prev_end_col + (e->tabs.items[lo].offset - prev_end_offset) <= view_col) {
+        // view_col is in the middle of an expanded tab
+        const Tab *tab = &e->tabs.items[lo];
+        while (n < cols && view_col + n < tab->col) dst[n++] = ' ';
+        offset = tab->offset + 1;
+        col = tab->col;
+    } else {
+        offset = prev_end_offset + (view_col - prev_end_col);
+        col = view_col;
+    }
+
+    for (; offset < line->end && n < cols; ++offset) {
+        char x = e->data.items[offset];
+        if (x == '\t') {
+            size_t next_col = (col/e->tab_width + 1)*e->tab_width;
+            while (n < cols && col < next_col) {
+                dst[n++] = ' ';
+                col += 1;
+            }
+        } else {
+            dst[n++] = x;
+            col += 1;
+        }
+    }
+    return n;
+}
+
+// Shown width of the field `field` of the size `size` in the column view. Only the first
+// COLUMNS_MAX_FIELDS fields are aligned.
+size_t columns_field_width(const Columns *c, size_t field, size_t size)
+{
+    return field < COLUMNS_MAX_FIELDS ? c->widths[field] : size;
+}
+
+// Makes the columns as wide as their widest fields on the visible rows
+void editor_columns_sample_widths(Editor *e, size_t rows)
+{
+    Columns *c = &e->columns;
+    memset(c->widths, 0, sizeof(c->widths));
+    size_t row = e->view_row;
+    for (size_t i = 0; i < rows; ++i) {
+        size_t count;
+        const size_t *delims = editor_row_delims(e, row, &count);
+        size_t size = e->lines.items[row].end - e->lines.items[row].begin;
+        for (size_t k = 0; k <= count && k < COLUMNS_MAX_FIELDS; ++k) {
+            size_t begin = k == 0 ? 0 : delims[k - 1] + 1;
+            size_t end = k < count ? delims[k] : size;
+            size_t width = end - begin;
+            if (width > COLUMNS_MAX_WIDTH) width = COLUMNS_MAX_WIDTH;
+            if (width > c->widths[k]) c->widths[k] = width;
+        }
+        if (!editor_next_visible_row(e, row, &row)) break;
+    }
+}
+
+// Visual column of the position `offset` of the row `row` in the column view
+size_t editor_columns_visual_col(Editor *e, size_t row, size_t offset)
+{
+    size_t count;
+    const size_t *delims = editor_row_delims(e, row, &count);
+    size_t size = e->lines.items[row].end - e->lines.items[row].begin;
+    size_t o = offset - e->lines.items[row].begin;
+    size_t x = 0;
+    for (size_t k = 0; k <= count; ++k) {
+        size_t begin = k == 0 ? 0 : delims[k - 1] + 1;
+        size_t end = k < count ? delims[k] : size;
+        size_t width = columns_field_width(&e->columns, k, end - begin);
+        if (o <= end) {
+            // The delimiter itself is shown as the middle of the separator
+            if (o == end && k < count) return x + width + strlen(COLUMNS_SEPARATOR)/2;
+            return x + (o - begin < width ? o - begin : width);
+        }
+        x += width + strlen(COLUMNS_SEPARATOR);
+    }
+    return x;
+}
+
+// Renders the fields of the row aligned into the columns, starting from e->view_col. The
+// fields that don't fit into their columns are cut and marked with `>`.
+size_t editor_render_line_with_columns(Editor *e, size_t row, char *dst, uint8_t *styles, size_t cols)
+{
+    const Line *line = &e->lines.items[row];
+    size_t count;
+    const size_t *delims = editor_row_delims(e, row, &count);
+    size_t size = line->end - line->begin;
+    size_t view_col = e->view_col;
+    size_t separator_size = strlen(COLUMNS_SEPARATOR);
+
+    size_t n = 0;
+    size_t x = 0;
+    for (size_t k = 0; k <= count && x < view_col + cols; ++k) {
+        size_t begin = k == 0 ? 0 : delims[k - 1] + 1;
+        size_t end = k < count ? delims[k] : size;
+        size_t field_size = end - begin;
+        size_t width = columns_field_width(&e->columns, k, field_size);
+        for (size_t j = 0; j < width && x + j < view_col + cols; ++j) {
+            if (x + j < view_col) continue;
+            size_t i = x + j - view_col;
+            if (j + 1 == width && field_size > width) {
+                dst[i] = '>';
+                styles[i] = STYLE_TILDE;
+            } else {
+                char ch = j < field_size ? e->data.items[line->begin + begin + j] : ' ';
+                dst[i] = ch == '\t' ? ' ' : ch;
+            }
+            n = i + 1;
+        }
+        x += width;
+        if (k == count) break;
+        for (size_t j = 0; j < separator_size && x + j < view_col + cols; ++j) {
+            if (x + j < view_col) continue;
+            size_t i = x + j - view_col;
+            dst[i] = COLUMNS_SEPARATOR[j];
+            styles[i] = STYLE_TILDE;
+            n = i + 1;
+        }
+        x += separator_size;
+    }
+    return n;
+}
+
+// Popup with the candidates of the completion under the cursor, or above it if
+// there is no space below. `col` is where the completed word starts on the screen.
+void display_render_completion(Display *d, const Completion *c, size_t col, size_t rows)
+{
+    size_t width = 0;
+    for (size_t i = 1; i <= c->count; ++i) {
+        size_t size = c->ends[i] - c->ends[i - 1];
+        if (size > width) width = size;
+    }
+    width += 2;
+    if (width > d->cols) width = d->cols;
+    if (col + width > d->cols) col = d->cols - width;
+
+    size_t height = c->count;
+    size_t top = d->cursor_row + 1;
+    if (top + height > rows) {
+        if (d->cursor_row >= height) {
+            top = d->cursor_row - height;
+        } else {
+            height = rows - top;
+        }
+    }
+
+    for (size_t i = 0; i < height; ++i) {
+        size_t row = top + i;
+        const char *candidate = c->text.items + c->ends[i];
+        size_t size = c->ends[i + 1] - c->ends[i];
+        if (size > width - 1) size = width - 1;
+        char *chars = d->chars + row*d->cols + col;
+        memset(chars, ' ', width);
+        memcpy(chars + 1, candidate, size);
+        memset(d->styles + row*d->cols + col, i + 1 == c->selected ? STYLE_POPUP_SELECTED : STYLE_POPUP, width*sizeof(*d->styles));
+        if (d->ends[row] < col + width) d->ends[row] = col + width;
+    }
+}
+
+void editor_rerender(Editor *e, bool insert, Display *d)
+{
+    const char *insert_label = "-- INSERT --";
+
+    for (size_t i = 0; i < d->rows*d->cols; ++i) {
+        d->chars[i] = ' ';
+    }
+    memset(d->styles, STYLE_DEFAULT, d->rows*d->cols*sizeof(*d->styles));
+    memset(d->ends, 0, d->rows*sizeof(*d->ends));
+
+    size_t rows = d->rows;
+    size_t cols = d->cols;
+
+    if (rows < 2 || cols < strlen(insert_label)) return;
+
+    rows -= 1;
+    // Column of the git marks for the files in git
+    size_t gutter = e->git.tracked ? 1 : 0;
+    cols -= gutter;
+
+    size_t cursor_row = editor_current_line(e);
+    size_t cursor_col = editor_visual_col(e, cursor_row, e->cursor);
+    // Motions that go character by character can get the cursor into a fold. Open it then.
+    for (const Fold *fold = editor_fold_hiding(e, cursor_row); fold != NULL; fold = editor_fold_hiding(e, cursor_row)) {
+        editor_unfold(e, fold);
+    }
+    editor_scroll_to_row(e, cursor_row, rows);
+    if (e->columns.active) {
+        editor_columns_sample_widths(e, rows);
+        cursor_col = editor_columns_visual_col(e, cursor_row, e->cursor);
+    }
+
+    if (cursor_col < e->view_col) {
+        e->view_col = cursor_col;
+    }
+    if (cursor_col >= e->view_col + cols) {
+        e->view_col = cursor_col - cols + 1;
+    }
+
+    size_t partner;
+    size_t partner_row = SIZE_MAX;
+    size_t partner_col = 0;
+    if (!e->columns.active && editor_cursor_bracket_partner(e, &partner)) {
+        partner_row = editor_row_of(e, partner);
+        partner_col = editor_visual_col(e, partner_row, partner);
+    }
+
+    size_t row = e->view_row;
+    bool has_row = true;
+    for (size_t i = 0; i < rows; ++i) {
+        if (has_row) {
+            const Line *line = &e->lines.items[row];
+            char *chars = d->chars + i*d->cols + gutter;
+            uint8_t *styles = d->styles + i*d->cols + gutter;
+            size_t end;
+            if (e->columns.active) {
+                end = editor_render_line_with_columns(e, row, chars, styles, cols);
+            } else if (line->tabs_begin == line->tabs_end) {
+                const char *line_start = e->data.items + line->begin;
+                size_t line_size = line->end - line->begin;
+                size_t view_col = e->view_col;
+                if (view_col > line_size) view_col = line_size;
+                line_start += view_col;
+                line_size -= view_col;
+                if (line_size > cols) line_size = cols;
+                memcpy(chars, line_start, line_size);
+                end = line_size;
+            } else {
+                end = editor_render_line_with_tabs(e, row, chars, cols);
+            }
+            // Trailing whitespace of the line is as blank as the rest of the row
+            while (end > 0 && chars[end - 1] == ' ') end -= 1;
+
+            if (row == partner_row && partner_col >= e->view_col && partner_col - e->view_col < end) {
+                styles[partner_col - e->view_col] = STYLE_MATCH;
+            }
+
+            const Fold *fold = editor_fold_at(e, row);
+            if (fold) {
+                char marker[64];
+                int marker_size = snprintf(marker, sizeof(marker), " [+%zu lines]", fold->last - fold->first);
+                if (marker_size > 0 && end + marker_size <= cols) {
+                    memcpy(chars + end, marker, marker_size);
+                    memset(styles + end, STYLE_TILDE, marker_size*sizeof(*styles));
+                    end += marker_size;
+                }
+            }
+
+            // The marks may be behind the edits for a moment, see Git_Job
+            if (gutter > 0 && row < e->git.marks.count && e->git.marks.items[row] != GIT_UNCHANGED) {
+                static const char signs[] = {
+                    [GIT_ADDED] = '+',
+                    [GIT_MODIFIED] = '~',
+                    [GIT_DELETED] = '_',
+                };
+                Git_Mark mark = e->git.marks.items[row];
+                d->chars[i*d->cols] = signs[mark];
+                d->styles[i*d->cols] = mark == GIT_ADDED ? STYLE_GIT_ADDED : mark == GIT_MODIFIED ? STYLE_GIT_MODIFIED : STYLE_GIT_DELETED;
+            }
+            d->ends[i] = gutter + end;
+
+            has_row = editor_next_visible_row(e, row, &row);
+        } else {
+            memcpy(d->chars + i*d->cols, "~", 1);
+            d->styles[i*d->cols] = STYLE_TILDE;
+            d->ends[i] = 1;
+        }
+    }
+
+    cursor_col -= e->view_col;
+    if (cursor_col > cols) cursor_col = cols;
+    d->cursor_row = editor_count_visible_rows(e, e->view_row, cursor_row) - 1;
+    d->cursor_col = gutter + cursor_col;
+
+    if (insert && e->completion.active) {
+        size_t begin_col = e->columns.active
+            ? editor_columns_visual_col(e, cursor_row, e->completion.begin)
+            : editor_visual_col(e, cursor_row, e->completion.begin);
+        display_render_completion(d, &e->completion, gutter + (begin_col > e->view_col ? begin_col - e->view_col : 0), rows);
+    }
+
+    // Status row, which spans the gutter too
+    cols = d->cols;
+    char *status = d->chars + rows*d->cols;
+    uint8_t *status_styles = d->styles + rows*d->cols;
+    size_t n = 0;
+    if (e->prompt.kind != PROMPT_NONE) {
+        // The last cell is left for the cursor. The labels can be wider than the
+        // narrowest terminal, then they are cut.
+        size_t label_size = strlen(e->prompt.label);
+        if (label_size > cols - 1) label_size = cols - 1;
+        memcpy(status, e->prompt.label, label_size);
+        memset(status_styles, STYLE_STATUS, label_size*sizeof(*status_styles));
+        n = label_size;
+        // Keep the end of the text visible
+        const char *text = e->prompt.text.items;
+        size_t text_size = e->prompt.text.count;
+        if (text_size > cols - n - 1) {
+            text += text_size - (cols - n - 1);
+            text_size = cols - n - 1;
+        }
+        memcpy(status + n, text, text_size);
+        n += text_size;
+        d->cursor_row = rows;
+        d->cursor_col = n;
+    } else {
+        if (insert) {
+            memcpy(status, insert_label, strlen(insert_label));
+            memset(status_styles, STYLE_STATUS, strlen(insert_label)*sizeof(*status_styles));
+            n = strlen(insert_label) + 2;
+        }
+        size_t status_size = e->status.count;
+        if (n + status_size > cols) status_size = n < cols ? cols - n : 0;
+        memcpy(status + n, e->status.items, status_size);
+        n += status_size;
+
+        if (e->filter.active) {
+            char label[64];
+            int label_size = snprintf(label, sizeof(label), "[filter: %zu lines]", e->filter.rows.count);
+            if (label_size > 0 && n + label_size + 1 <= cols) {
+                memcpy(status + cols - label_size, label, label_size);
+                memset(status_styles + cols - label_size, STYLE_STATUS, label_size*sizeof(*status_styles));
+                n = cols;
+            }
+        }
+    }
+    while (n > 0 && status[n - 1] == ' ') n -= 1;
+    d->ends[rows] = n;
+}
+
+bool editor_save_to_file(Editor *e, const char *file_path)
+{
+    bool result = true;
+    int fd = open(file_path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        // TODO: we need to log something here,
+        // but we can't easily do that if we are already in the special terminal mode with
+        // no ECHO and no ICANON (it will just look weird).
+        //
+        // Maybe we could start bubbling up errors through return values like in Go? But that may
+        // require dynamic memory management.
+        //
+        // We can just create a dedicated arena for the bubbling errors. I had this idea for quite some
+        // time already, maybe we can test it in here.
+        fprintf(stderr, "ERROR: could not open file %s for writing: %s\n", file_path, strerror(errno));
+        return_defer(false);
+    }
+    ssize_t n = write(fd, e->data.items, e->data.count);
+    if (n < 0) {
+        fprintf(stderr, "ERROR: could not write into file %s: %s\n", file_path, strerror(errno));
+        return_defer(false);
+    }
+    while ((size_t) n < e->data.count) {
+        ssize_t m = write(fd, e->data.items + n, e->data.count - n);
+        if (m < 0) {
+            fprintf(stderr, "ERROR: could not write into file %s: %s\n", file_path, strerror(errno));
+            return_defer(false);
+        }
+        n += m;
+    }
+    e->saved_generation = e->generation;
+defer:
+    if (fd >= 0) UNUSED(close(fd));
+    return result;
+}
+
+// `tags` file generated by ctags(1), mapped into memory as is. When the file says
+// it is sorted, the tags are looked up with a binary search over the lines.
+typedef struct {
+    const char *items;
+    size_t count;
+    bool sorted;
+    // To notice when ctags(1) regenerates the file
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+} Tags;
+
+typedef struct {
+    const char *name;
+    size_t name_size;
+    const char *file;
+    size_t file_size;
+    const char *address; // Line number or /pattern/
+    size_t address_size;
+} Tag;
+
+void tags_close(Tags *t)
+{
+    if (t->items != NULL) munmap((void *) t->items, t->count);
+    *t = (Tags) {0};
+}
+
+// Maps the tags file if it is not mapped yet or was changed since
+bool tags_open(Tags *t, const char *file_path)
+{
+    struct stat statbuf;
+    if (stat(file_path, &statbuf) < 0) {
+        tags_close(t);
+        return false;
+    }
+    if (t->items != NULL && t->dev == statbuf.st_dev && t->ino == statbuf.st_ino &&
+        t->mtime.tv_sec == statbuf.st_mtim.tv_sec && t->mtime.tv_nsec == statbuf.st_mtim.tv_nsec) {
+        return true;
+    }
+    tags_close(t);
+    if (statbuf.st_size == 0) return false;
+
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) return false;
+    void *items = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (items == MAP_FAILED) return false;
+
+    t->items = items;
+    t->count = statbuf.st_size;
+    t->dev = statbuf.st_dev;
+    t->ino = statbuf.st_ino;
+    t->mtime = statbuf.st_mtim;
+
+    const char *sorted = "!_TAG_FILE_SORTED\t";
+    const char *header = memmem(t->items, t->count, sorted, strlen(sorted));
+    t->sorted = header != NULL && (size_t) (header - t->items) + strlen(sorted) < t->count && header[strlen(sorted)] == '1';
+    return true;
+}
+
+// Beginning of the line containing `offset`... or of the next line, if `offset` is not
+// at the beginning of its line
+size_t tags_next_line(const Tags *t, size_t offset)
+{
+    if (offset == 0 || t->items[offset - 1] == '\n') return offset;
+    const char *newline = memchr(t->items + offset, '\n', t->count - offset);
+    return newline ? (size_t) (newline - t->items) + 1 : t->count;
+}
+
+int tags_compare_line(const Tags *t, size_t line, const char *name, size_t name_size)
+{
+    const char *end = t->items + t->count;
+    const char *tab = memchr(t->items + line, '\t', t->count - line);
+    const char *newline = memchr(t->items + line, '\n', t->count - line);
+    if (tab == NULL || (newline != NULL && newline < tab)) tab = newline ? newline : end;
+    return word_compare(t->items + line, tab - (t->items + line), name, name_size);
+}
+
+bool tags_parse_line(const Tags *t, size_t line, Tag *tag)
+{
+    const char *p = t->items + line;
+    const char *end = memchr(p, '\n', t->count - line);
+    if (end == NULL) end = t->items + t->count;
+
+    const char *fields[3];
+    size_t sizes[3];
+    for (size_t i = 0; i < 3; ++i) {
+        const char *tab = memchr(p, '\t', end - p);
+        if (tab == NULL) {
+            if (i < 2) return false;
+            tab = end;
+        }
+        fields[i] = p;
+        sizes[i] = tab - p;
+        p = tab < end ? tab + 1 : end;
+    }
+    // The address is an ex command terminated by `;"` if there are extension fields
+    if (sizes[2] >= 2 && memcmp(fields[2] + sizes[2] - 2, ";\"", 2) == 0) sizes[2] -= 2;
+
+    *tag = (Tag) {
+        .name = fields[0], .name_size = sizes[0],
+        .file = fields[1], .file_size = sizes[1],
+        .address = fields[2], .address_size = sizes[2],
+    };
+    return true;
+}
+
+// Finds the first tag with the name. O(log n) in the size of the file for the
+// sorted files, which is what ctags(1) generates by default.
+bool tags_find(const Tags *t, const char *name, size_t name_size, Tag *tag)
+{
+    if (t->items == NULL) return false;
+
+    size_t lo = 0;
+    size_t hi = t->count;
+    if (t->sorted) {
+        // Invariant: the first line with the name, if any, starts in [lo, hi]
+        while (lo < hi) {
+            size_t line = tags_next_line(t, lo + (hi - lo)/2);
+            if (line >= hi) break;
+            if (tags_compare_line(t, line, name, name_size) < 0) {
+                lo = tags_next_line(t, line + 1);
+            } else {
+                hi = line;
+            }
+        }
+    }
+
+    // Unsorted file, or the range is within a couple of lines
+    for (size_t line = lo; line < t->count; line = tags_next_line(t, line + 1)) {
+        int cmp = tags_compare_line(t, line, name, name_size);
+        if (cmp == 0) return tags_parse_line(t, line, tag);
+        if (t->sorted && cmp > 0) return false;
+    }
+    return false;
+}
+
+typedef struct {
+    size_t buffer;
+    size_t anchor; // In the anchors of the buffer, so the location follows the edits
+} Location;
+
+typedef struct {
+    Location *items;
+    size_t count;
+    size_t capacity;
+} Locations;
+
+#define MARKS_PATH "*marks*"
+
+typedef struct {
+    char *name;
+    size_t buffer;
+    size_t anchor; // In the anchors of the buffer
+} Mark;
+
+typedef struct {
+    Mark *items;
+    size_t count;
+    size_t capacity;
+} Marks;
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} Paths;
+
+#define GREP_MAX_LINE_SIZE 256
+#define GREP_BINARY_PROBE_SIZE 8000
+#define GREP_CHUNK_SIZE (1024*1024) // How much of a file is searched between the checks of the cancel flag
+#define GREP_RESULTS_PATH "*grep*"
+
+typedef struct Walk Walk;
+
+// Processes a file found by the walk, appending the results to `out`. Returns the
+// amount of the results.
+typedef size_t (*Walk_Visit)(Walk *w, const char *file_path, Data *out);
+
+// Walk over all the files under the current directory in the background. The
+// directories are walked by a pool of worker threads that take them from a shared
+// stack and push the subdirectories they find back onto it. The results of the
+// visits are handed over to the event loop as they come, poking it through the
+// `notify` pipe.
+struct Walk {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t threads[MAX_WORKERS];
+    size_t threads_count;
+    bool initialized; // The lock and the pipe are created by the first search
+    int notify[2];
+
+    // Immutable while the workers are running
+    Walk_Visit visit;
+    char *pattern; // What grep_file() searches for
+    size_t pattern_size;
+    Paths ignored; // fnmatch(3) patterns from .gitignore
+    int inotify;   // If not negative, all the walked directories are watched with it
+
+    // Protected by the lock
+    Paths dirs;    // Directories waiting to be walked
+    size_t busy;   // Workers that are walking a directory right now
+    bool cancel;
+    bool done;
+    Data results;  // Results of the visits that the event loop has not taken yet
+    size_t files;
+    size_t matches;
+};
+
+char *path_join(const char *dir, const char *name)
+{
+    char *path;
+    if (strcmp(dir, ".") == 0) {
+        path = strdup(name);
+    } else if (asprintf(&path, "%s/%s", dir, name) < 0) {
+        path = NULL;
+    }
+    ASSERT(path != NULL, "Buy more RAM lol");
+    return path;
+}
+
+void paths_free(Paths *paths)
+{
+    for (size_t i = 0; i < paths->count; ++i) {
+        free(paths->items[i]);
+    }
+    free(paths->items);
+    *paths = (Paths) {0};
+}
+
+// Reads the patterns of the .gitignore in the current directory. Negations and the
+// patterns with slashes in the middle are not supported, the rest are matched
+// against the names of the files and the directories.
+void paths_load_ignored(Paths *ignored, const char *file_path)
+{
+    FILE *f = fopen(file_path, "r");
+    if (f == NULL) return;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = strlen(line);
+        while (n > 0 && isspace((unsigned char) line[n - 1])) line[--n] = '\0';
+        if (n > 0 && line[n - 1] == '/') line[--n] = '\0';
+        char *pattern = line;
+        if (pattern[0] == '/') pattern += 1;
+        if (pattern[0] == '\0' || pattern[0] == '#' || pattern[0] == '!' || strchr(pattern, '/')) continue;
+        char *copy = strdup(pattern);
+        ASSERT(copy != NULL, "Buy more RAM lol");
+        da_append(ignored, copy);
+    }
+    fclose(f);
+}
+
+bool paths_match(const Paths *patterns, const char *name)
+{
+    for (size_t i = 0; i < patterns->count; ++i) {
+        if (fnmatch(patterns->items[i], name, 0) == 0) return true;
+    }
+    return false;
+}
+
+bool walk_cancelled(Walk *w)
+{
+    pthread_mutex_lock(&w->lock);
+    bool cancel = w->cancel;
+    pthread_mutex_unlock(&w->lock);
+    return cancel;
+}
+
+// Appends the lines of the file that contain the pattern to `out` as
+// `path:line:text\n`. Returns the amount of them.
+size_t grep_file(Walk *w, const char *file_path, Data *out)
+{
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = statbuf.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    size_t matches = 0;
+    // Files with zero bytes in the beginning are considered binary
+    if (memchr(data, '\0', size < GREP_BINARY_PROBE_SIZE ? size : GREP_BINARY_PROBE_SIZE) == NULL) {
+        size_t line_number = 1;
+        size_t counted = 0;
+        size_t offset = 0; // Beginning of the line after the last match
+        size_t search = 0;
+        while (search < size && !walk_cancelled(w)) {
+            // Huge files are searched chunk by chunk, so a cancelled search does not wait for them.
+            // The chunks overlap by the size of the pattern to find the matches on their borders.
+            size_t window = size - search;
+            bool last = window <= GREP_CHUNK_SIZE + w->pattern_size;
+            if (!last) window = GREP_CHUNK_SIZE + w->pattern_size;
+            const char *found = memmem(data + search, window, w->pattern, w->pattern_size);
+            if (found == NULL) {
+                if (last) break;
+                search += GREP_CHUNK_SIZE;
+                continue;
+            }
+
+            size_t begin = found - data;
+            while (begin > offset && data[begin - 1] != '\n') begin -= 1;
+            const char *newline = memchr(found, '\n', size - (found - data));
+            size_t end = newline ? (size_t) (newline - data) : size;
+            for (const char *p = data + counted; (p = memchr(p, '\n', begin - (p - data))) != NULL; ++p) {
+                line_number += 1;
+            }
+            counted = begin;
+
+            size_t line_size = end - begin;
+            if (line_size > GREP_MAX_LINE_SIZE) line_size = GREP_MAX_LINE_SIZE;
+            data_appendf(out, "%s:%zu:", file_path, line_number);
+            da_append_many(out, data + begin, line_size);
+            da_append(out, '\n');
+            matches += 1;
+            offset = end + 1;
+            search = offset;
+        }
+    }
+    munmap((void *) data, size);
+    return matches;
+}
+
+// Appends the path of the file to `out` as `path\n`
+size_t list_file(Walk *w, const char *file_path, Data *out)
+{
+    UNUSED(w);
+    data_appendf(out, "%s\n", file_path);
+    return 1;
+}
+
+void walk_dir(Walk *w, const char *dir_path)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) return;
+    if (w->inotify >= 0) {
+        UNUSED(inotify_add_watch(w->inotify, dir_path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR));
+    }
+
+    Data found = {0};
+    size_t files = 0;
+    size_t matches = 0;
+    struct dirent *entry;
+    while (!walk_cancelled(w) && (entry = readdir(dir)) != NULL) {
+        // Skips `.`, `..`, and the hidden files and directories like .git
+        if (entry->d_name[0] == '.') continue;
+        if (paths_match(&w->ignored, entry->d_name)) continue;
+
+        char *path = path_join(dir_path, entry->d_name);
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat statbuf;
+            if (lstat(path, &statbuf) == 0) {
+                if (S_ISDIR(statbuf.st_mode)) type = DT_DIR;
+                if (S_ISREG(statbuf.st_mode)) type = DT_REG;
+            }
+        }
+
+        if (type == DT_DIR) {
+            pthread_mutex_lock(&w->lock);
+            da_append(&w->dirs, path);
+            pthread_cond_signal(&w->wake);
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+        if (type == DT_REG) {
+            files += 1;
+            matches += w->visit(w, path, &found);
+        }
+        free(path);
+    }
+    closedir(dir);
+
+    pthread_mutex_lock(&w->lock);
+    da_append_many(&w->results, found.items, found.count);
+    w->files += files;
+    w->matches += matches;
+    pthread_mutex_unlock(&w->lock);
+    if (found.count > 0) UNUSED(write(w->notify[1], "w", 1));
+    free(found.items);
+}
+
+void *walk_worker(void *arg)
+{
+    Walk *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->dirs.count == 0 && w->busy > 0 && !w->cancel) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if (w->cancel || w->dirs.count == 0) break;
+
+        char *dir_path = w->dirs.items[--w->dirs.count];
+        w->busy += 1;
+        pthread_mutex_unlock(&w->lock);
+        walk_dir(w, dir_path);
+        free(dir_path);
+        pthread_mutex_lock(&w->lock);
+        w->busy -= 1;
+    }
+    // Nothing left to walk, or the search is cancelled. Let the others know.
+    bool notify = !w->done;
+    w->done = true;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    if (notify) UNUSED(write(w->notify[1], "w", 1));
+    return NULL;
+}
+
+void walk_stop(Walk *w)
+{
+    if (w->threads_count == 0) return;
+    pthread_mutex_lock(&w->lock);
+    w->cancel = true;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    for (size_t i = 0; i < w->threads_count; ++i) {
+        pthread_join(w->threads[i], NULL);
+    }
+    w->threads_count = 0;
+    paths_free(&w->dirs);
+}
+
+bool walk_start(Walk *w, Walk_Visit visit, int inotify)
+{
+    walk_stop(w);
+    if (!w->initialized) {
+        if (pipe(w->notify) < 0) return false;
+        for (size_t i = 0; i < 2; ++i) {
+            fcntl(w->notify[i], F_SETFL, fcntl(w->notify[i], F_GETFL) | O_NONBLOCK);
+            fcntl(w->notify[i], F_SETFD, FD_CLOEXEC);
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        w->initialized = true;
+    }
+
+    w->visit = visit;
+    w->inotify = inotify;
+    paths_free(&w->ignored);
+    paths_load_ignored(&w->ignored, ".gitignore");
+
+    char *root = strdup(".");
+    ASSERT(root != NULL, "Buy more RAM lol");
+    da_append(&w->dirs, root);
+    w->busy = 0;
+    w->cancel = false;
+    w->done = false;
+    w->results.count = 0;
+    w->files = 0;
+    w->matches = 0;
+
+    size_t workers = parallel_workers_count();
+    for (size_t i = 0; i < workers; ++i) {
+        if (pthread_create(&w->threads[w->threads_count], NULL, walk_worker, w) != 0) break;
+        w->threads_count += 1;
+    }
+    if (w->threads_count == 0) {
+        paths_free(&w->dirs);
+        return false;
+    }
+    return true;
+}
+
+bool grep_start(Walk *w, const char *pattern, size_t pattern_size)
+{
+    walk_stop(w);
+    free(w->pattern);
+    w->pattern = malloc(pattern_size);
+    ASSERT(w->pattern != NULL, "Buy more RAM lol");
+    memcpy(w->pattern, pattern, pattern_size);
+    w->pattern_size = pattern_size;
+    return walk_start(w, grep_file, -1);
+}
+
+void walk_free(Walk *w)
+{
+    walk_stop(w);
+    if (w->initialized) {
+        close(w->notify[0]);
+        close(w->notify[1]);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+    }
+    free(w->pattern);
+    paths_free(&w->ignored);
+    free(w->results.items);
+    *w = (Walk) {0};
+}
+
+// Builds the Json_Index of a buffer in the background from a copy of its data, so the
+// buffer can be edited in the meantime. The result is thrown away if it was.
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool initialized;
+    int notify[2];
+    Editor *editor;
+    char *data;
+    size_t size;
+    size_t generation;
+    Json_Index index;
+} Json_Build;
+
+void *json_build_worker(void *arg)
+{
+    Json_Build *b = arg;
+    json_index_build(&b->index, b->data, b->size);
+    UNUSED(write(b->notify[1], "j", 1));
+    return NULL;
+}
+
+bool json_build_start(Json_Build *b, Editor *e)
+{
+    if (b->running) return false;
+    if (!b->initialized) {
+        if (pipe(b->notify) < 0) return false;
+        for (size_t i = 0; i < 2; ++i) {
+            fcntl(b->notify[i], F_SETFL, fcntl(b->notify[i], F_GETFL) | O_NONBLOCK);
+            fcntl(b->notify[i], F_SETFD, FD_CLOEXEC);
+        }
+        b->initialized = true;
+    }
+
+    b->editor = e;
+    b->generation = e->generation;
+    b->size = e->data.count;
+    b->data = malloc(b->size + 1);
+    ASSERT(b->data != NULL, "Buy more RAM lol");
+    memcpy(b->data, e->data.items, b->size);
+    if (pthread_create(&b->thread, NULL, json_build_worker, b) != 0) {
+        free(b->data);
+        b->data = NULL;
+        return false;
+    }
+    b->running = true;
+    return true;
+}
+
+// Waits for the build and gives the index to its buffer unless the buffer changed since
+void json_build_finish(Json_Build *b)
+{
+    if (!b->running) return;
+    pthread_join(b->thread, NULL);
+    b->running = false;
+    char drain[16];
+    while (read(b->notify[0], drain, sizeof(drain)) > 0) {}
+    free(b->data);
+    b->data = NULL;
+
+    Editor *e = b->editor;
+    if (e->generation == b->generation) {
+        // The arrays of the old index are reused by the next build
+        Json_Index old = e->json;
+        e->json = b->index;
+        e->json.generation = b->generation;
+        e->json.built = true;
+        b->index = old;
+    }
+}
+
+void json_build_free(Json_Build *b)
+{
+    json_build_finish(b);
+    if (b->initialized) {
+        close(b->notify[0]);
+        close(b->notify[1]);
+    }
+    free(b->index.offsets);
+    free(b->index.links);
+    *b = (Json_Build) {0};
+}
+
+bool editor_json_stale(const Editor *e)
+{
+    return editor_is_json(e) && (!e->json.built || e->json.generation != e->generation);
+}
+
+#define DIFF_RESULTS_PATH "*diff*"
+#define DIFF_CONTEXT 3
+// Deeper than that the region is just reported as changed
+#define DIFF_MAX_DEPTH 1024
+// Lines that occur more often are not good anchors, see diff_region()
+#define DIFF_MAX_OCCURRENCES 64
+
+typedef struct {
+    Editor *e;
+    bool on_disk;          // e is the saved file, not one of the buffers
+    struct timespec mtime; // Of the file when on_disk
+    size_t generation;     // Of e when the hashes were computed
+    Hashes hashes;         // Of every line of e
+} Diff_Side;
+
+// Line by line difference between two buffers, or a buffer and a file. After the
+// edits only the region between the unchanged matches around them is compared again.
+typedef struct {
+    bool active;
+    Diff_Side a; // Old
+    Diff_Side b; // New, the buffer the diff was started from
+    Diff_Matches matches;
+} Diff;
+
+uint64_t hash_bytes(const char *bytes, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        h = (h ^ word)*0x9E3779B97F4A7C15ULL;
+        h ^= h >> 32;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ (uint8_t) bytes[i])*0x100000001B3ULL;
+    }
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+typedef struct {
+    const Editor *e;
+    uint64_t *hashes;
+} Diff_Hash_Job;
+
+void diff_hash_lines_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    UNUSED(worker);
+    Diff_Hash_Job *job = ctx;
+    for (size_t row = begin; row < end; ++row) {
+        const Line *line = &job->e->lines.items[row];
+        uint64_t hash = hash_bytes(job->e->data.items + line->begin, line->end - line->begin);
+        // The last line without the newline differs from the same line with it
+        job->hashes[row] = line->end == job->e->data.count ? ~hash : hash;
+    }
+}
+
+// Finds the lines [first, old_end) of `old` that became [first, new_end) of `new`. All
+// three are the amount of lines if nothing changed.
+void hashes_changed_range(const Hashes *old, const Hashes *new, size_t *first, size_t *old_end, size_t *new_end)
+{
+    size_t old_count = old->count;
+    size_t new_count = new->count;
+    size_t min_count = old_count < new_count ? old_count : new_count;
+    size_t prefix = 0;
+    while (prefix < min_count && old->items[prefix] == new->items[prefix]) prefix += 1;
+    if (prefix == old_count && old_count == new_count) {
+        *first = *old_end = *new_end = old_count;
+        return;
+    }
+    size_t suffix = 0;
+    while (prefix + suffix < min_count && old->items[old_count - suffix - 1] == new->items[new_count - suffix - 1]) suffix += 1;
+    *first = prefix;
+    *old_end = old_count - suffix;
+    *new_end = new_count - suffix;
+}
+
+// Hashes the lines of the data the same way as diff_hash_lines_job() does for the buffers
+void hash_data_lines(const char *data, size_t size, Hashes *out)
+{
+    out->count = 0;
+    size_t begin = 0;
+    while (begin < size) {
+        const char *newline = memchr(data + begin, '\n', size - begin);
+        size_t end = newline ? (size_t) (newline - data) : size;
+        uint64_t hash = hash_bytes(data + begin, end - begin);
+        da_append(out, newline ? hash : ~hash);
+        begin = end + 1;
+    }
+}
+
+// Rehashes the lines of the side and finds the rows [first, old_end) that became
+// [first, new_end). Both ends are the amount of lines if nothing changed.
+void diff_side_rehash(Diff_Side *s, Hashes *scratch, size_t *first, size_t *old_end, size_t *new_end)
+{
+    const Editor *e = s->e;
+    if (s->generation == e->generation && s->hashes.count > 0) {
+        *first = *old_end = *new_end = s->hashes.count;
+        return;
+    }
+    scratch->count = 0;
+    size_t count = editor_file_lines_count(e);
+    da_reserve(scratch, count);
+    scratch->count = count;
+    parallel_for(count, 16*1024, &(Diff_Hash_Job) { .e = e, .hashes = scratch->items }, diff_hash_lines_job);
+
+    hashes_changed_range(&s->hashes, scratch, first, old_end, new_end);
+
+    Hashes old = s->hashes;
+    s->hashes = *scratch;
+    *scratch = old;
+    s->generation = e->generation;
+}
+
+void diff_append_match(Diff_Matches *m, size_t a, size_t b, size_t count)
+{
+    if (count == 0) return;
+    if (m->count > 0) {
+        Diff_Match *last = &m->items[m->count - 1];
+        if (last->a + last->count == a && last->b + last->count == b) {
+            last->count += count;
+            return;
+        }
+    }
+    da_append(m, ((Diff_Match) { .a = a, .b = b, .count = count }));
+}
+
+typedef struct {
+    uint64_t hash;
+    uint32_t count_a;
+    uint32_t count_b;
+    uint32_t a; // First occurrence
+    uint32_t b;
+} Diff_Slot;
+
+typedef struct {
+    size_t a;
+    size_t b;
+} Diff_Anchor;
+
+Diff_Slot *diff_slot(Diff_Slot *slots, size_t capacity, uint64_t hash)
+{
+    size_t i = hash & (capacity - 1);
+    while (slots[i].count_a > 0 && slots[i].hash != hash) i = (i + 1) & (capacity - 1);
+    return &slots[i];
+}
+
+// Patience diff of the lines A[a0, a1) and B[b0, b1) by their hashes. Appends the
+// matches in order. After cutting off the common beginning and end, the lines that occur
+// exactly once on both sides are matched with the longest increasing subsequence and the
+// regions between them are diffed the same way. When there are no such lines, the line
+// that occurs the least is matched instead, like in the histogram diff of git.
+void diff_region(Diff_Matches *m, const uint64_t *A, size_t a0, size_t a1, const uint64_t *B, size_t b0, size_t b1, size_t depth)
+{
+    size_t prefix = 0;
+    while (a0 + prefix < a1 && b0 + prefix < b1 && A[a0 + prefix] == B[b0 + prefix]) prefix += 1;
+    diff_append_match(m, a0, b0, prefix);
+    a0 += prefix;
+    b0 += prefix;
+    size_t suffix = 0;
+    while (a0 < a1 - suffix && b0 < b1 - suffix && A[a1 - suffix - 1] == B[b1 - suffix - 1]) suffix += 1;
+    a1 -= suffix;
+    b1 -= suffix;
+
+    if (a0 < a1 && b0 < b1 && depth < DIFF_MAX_DEPTH) {
+        // Only the lines of A are counted on the side of B, the rest can't match anyway
+        size_t capacity = 16;
+        while (capacity < 2*(a1 - a0)) capacity *= 2;
+        Diff_Slot *slots = calloc(capacity, sizeof(*slots));
+        ASSERT(slots != NULL, "Buy more RAM lol");
+        for (size_t i = a0; i < a1; ++i) {
+            Diff_Slot *slot = diff_slot(slots, capacity, A[i]);
+            if (slot->count_a == 0) {
+                slot->hash = A[i];
+                slot->a = i;
+            }
+            slot->count_a += 1;
+        }
+        for (size_t j = b0; j < b1; ++j) {
+            Diff_Slot *slot = diff_slot(slots, capacity, B[j]);
+            if (slot->count_a == 0) continue;
+            if (slot->count_b == 0) slot->b = j;
+            slot->count_b += 1;
+        }
+
+        // Patience sorting of the unique pairs by their position in B. They are already
+        // ordered by A. `piles` holds the last pair of each pile, `prev` links each pair
+        // to the top of the previous pile at the moment it was placed.
+        Diff_Anchor *pairs = malloc((a1 - a0)*sizeof(*pairs));
+        size_t *prev = malloc((a1 - a0)*sizeof(*prev));
+        size_t *piles = malloc((a1 - a0)*sizeof(*piles));
+        ASSERT(pairs != NULL && prev != NULL && piles != NULL, "Buy more RAM lol");
+        size_t pairs_count = 0;
+        size_t piles_count = 0;
+        for (size_t i = a0; i < a1; ++i) {
+            const Diff_Slot *slot = diff_slot(slots, capacity, A[i]);
+            if (slot->count_a != 1 || slot->count_b != 1) continue;
+            size_t lo = 0;
+            size_t hi = piles_count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo)/2;
+                if (pairs[piles[mid]].b < slot->b) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            pairs[pairs_count] = (Diff_Anchor) { .a = i, .b = slot->b };
+            prev[pairs_count] = lo > 0 ? piles[lo - 1] : SIZE_MAX;
+            piles[lo] = pairs_count;
+            if (lo == piles_count) piles_count += 1;
+            pairs_count += 1;
+        }
+
+        size_t anchors_count = 0;
+        if (piles_count > 0) {
+            // The subsequence is walked back from the top of the last pile, so it is
+            // collected at the end of `piles` in reverse
+            for (size_t k = piles[piles_count - 1]; k != SIZE_MAX; k = prev[k]) {
+                piles[a1 - a0 - 1 - anchors_count++] = k;
+            }
+        } else {
+            const Diff_Slot *best = NULL;
+            for (size_t i = 0; i < capacity; ++i) {
+                const Diff_Slot *slot = &slots[i];
+                if (slot->count_b == 0 || slot->count_a + slot->count_b > DIFF_MAX_OCCURRENCES) continue;
+                if (best == NULL || slot->count_a + slot->count_b < best->count_a + best->count_b) best = slot;
+            }
+            if (best != NULL) {
+                pairs[0] = (Diff_Anchor) { .a = best->a, .b = best->b };
+                piles[a1 - a0 - 1] = 0;
+                anchors_count = 1;
+            }
+        }
+        free(slots);
+        free(prev);
+
+        size_t a = a0;
+        size_t b = b0;
+        for (size_t k = a1 - a0 - anchors_count; k < a1 - a0; ++k) {
+            Diff_Anchor anchor = pairs[piles[k]];
+            diff_region(m, A, a, anchor.a, B, b, anchor.b, depth + 1);
+            diff_append_match(m, anchor.a, anchor.b, 1);
+            a = anchor.a + 1;
+            b = anchor.b + 1;
+        }
+        free(pairs);
+        free(piles);
+        if (anchors_count > 0) diff_region(m, A, a, a1, B, b, b1, depth + 1);
+    }
+
+    diff_append_match(m, a1, b1, suffix);
+}
+
+// Brings the matches up to date after the lines [first, old_end) of the sides were
+// replaced with [first, new_end). The matches that are entirely before or after the
+// changed lines of both sides are kept, and only the lines between them are diffed again.
+void diff_update(Diff_Matches *matches, const Hashes *a_hashes, const Hashes *b_hashes, size_t a_first, size_t a_old_end, size_t a_new_end, size_t b_first, size_t b_old_end, size_t b_new_end)
+{
+    size_t a_count = a_hashes->count;
+    size_t b_count = b_hashes->count;
+    // The offsets are shifted with the wrapping arithmetic, which also works when the side shrinks
+    size_t a_shift = a_new_end - a_old_end;
+    size_t b_shift = b_new_end - b_old_end;
+    // The side that did not change must not limit what is kept
+    if (a_first == a_count && a_old_end == a_count && a_new_end == a_count) a_old_end = 0;
+    if (b_first == b_count && b_old_end == b_count && b_new_end == b_count) b_old_end = 0;
+
+    Diff_Matches *old = matches;
+    Diff_Matches m = {0};
+    size_t before = 0;
+    for (; before < old->count; ++before) {
+        Diff_Match x = old->items[before];
+        if (x.a >= a_first || x.b >= b_first) break;
+        size_t count = x.count;
+        if (count > a_first - x.a) count = a_first - x.a;
+        if (count > b_first - x.b) count = b_first - x.b;
+        diff_append_match(&m, x.a, x.b, count);
+        if (count < x.count) break;
+    }
+
+    size_t after = old->count;
+    size_t a_resume = a_count;
+    size_t b_resume = b_count;
+    while (after > before) {
+        Diff_Match x = old->items[after - 1];
+        size_t skip = 0;
+        if (x.a < a_old_end && a_old_end - x.a > skip) skip = a_old_end - x.a;
+        if (x.b < b_old_end && b_old_end - x.b > skip) skip = b_old_end - x.b;
+        if (skip >= x.count) break;
+        a_resume = x.a + skip + a_shift;
+        b_resume = x.b + skip + b_shift;
+        after -= 1;
+        if (skip > 0) break;
+    }
+
+    size_t a = m.count > 0 ? m.items[m.count - 1].a + m.items[m.count - 1].count : 0;
+    size_t b = m.count > 0 ? m.items[m.count - 1].b + m.items[m.count - 1].count : 0;
+    diff_region(&m, a_hashes->items, a, a_resume, b_hashes->items, b, b_resume, 0);
+    for (size_t i = after; i < old->count; ++i) {
+        Diff_Match x = old->items[i];
+        size_t skip = 0;
+        if (i == after) {
+            skip = a_resume - a_shift - x.a;
+        }
+        diff_append_match(&m, x.a + skip + a_shift, x.b + skip + b_shift, x.count - skip);
+    }
+
+    free(old->items);
+    *old = m;
+}
+
+void diff_side_free(Diff_Side *s)
+{
+    if (s->on_disk && s->e != NULL) {
+        editor_free_buffers(s->e);
+        free(s->e);
+    }
+    free(s->hashes.items);
+    *s = (Diff_Side) {0};
+}
+
+void diff_free(Diff *d)
+{
+    diff_side_free(&d->a);
+    diff_side_free(&d->b);
+    free(d->matches.items);
+    *d = (Diff) {0};
+}
+
+// Reads the version of the file in HEAD with `git show`. Returns false if the file is
+// not in a git repository or not committed.
+bool git_show_head(const char *file_path, Data *out)
+{
+    bool result = true;
+    int pipe_fds[2] = {-1, -1};
+    pid_t pid = -1;
+    posix_spawn_file_actions_t actions;
+    bool actions_initialized = false;
+
+    // Running git from the directory of the file makes it find the repository and lets
+    // us name the file relative to it
+    char dir[PATH_MAX];
+    char object[PATH_MAX + 16];
+    const char *slash = strrchr(file_path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        snprintf(object, sizeof(object), "HEAD:./%s", file_path);
+    } else {
+        size_t dir_size = slash - file_path;
+        if (dir_size == 0) dir_size = 1;
+        if (dir_size >= sizeof(dir)) return_defer(false);
+        memcpy(dir, file_path, dir_size);
+        dir[dir_size] = '\0';
+        snprintf(object, sizeof(object), "HEAD:./%s", slash + 1);
+    }
+
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) return_defer(false);
+    if (posix_spawn_file_actions_init(&actions) != 0) return_defer(false);
+    actions_initialized = true;
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char *argv[] = {"git", "-C", dir, "show", object, NULL};
+    if (posix_spawnp(&pid, "git", &actions, NULL, argv, environ) != 0) {
+        pid = -1;
+        return_defer(false);
+    }
+    close(pipe_fds[1]);
+    pipe_fds[1] = -1;
+
+    out->count = 0;
+    for (;;) {
+        da_reserve(out, out->count + 64*1024);
+        ssize_t n = read(pipe_fds[0], out->items + out->count, 64*1024);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->count += n;
+    }
+
+defer:
+    if (pipe_fds[0] >= 0) close(pipe_fds[0]);
+    if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+    if (actions_initialized) posix_spawn_file_actions_destroy(&actions);
+    if (pid > 0) {
+        int status = 0;
+        pid_t ret;
+        while ((ret = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {}
+        if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) result = false;
+    }
+    return result;
+}
+
+// Updates the marks of the rows from the gaps between the matches
+void git_gutter_mark(Git_Gutter *g, size_t rows)
+{
+    g->marks.count = 0;
+    da_reserve(&g->marks, rows);
+    memset(g->marks.items, GIT_UNCHANGED, rows);
+    g->marks.count = rows;
+
+    size_t a = 0;
+    size_t b = 0;
+    for (size_t i = 0; i <= g->matches.count; ++i) {
+        Diff_Match x = i < g->matches.count
+            ? g->matches.items[i]
+            : (Diff_Match) { .a = g->head.count, .b = g->lines.count };
+        if (x.b > b) {
+            memset(g->marks.items + b, x.a > a ? GIT_MODIFIED : GIT_ADDED, x.b - b);
+        } else if (x.a > a && rows > 0) {
+            size_t row = b < rows ? b : rows - 1;
+            if (g->marks.items[row] == GIT_UNCHANGED) g->marks.items[row] = GIT_DELETED;
+        }
+        a = x.a + x.count;
+        b = x.b + x.count;
+    }
+}
+
+// Diffs a snapshot of the buffer against HEAD in the background. The state of the
+// gutter is moved into the job for its duration, except for the marks, which keep being
+// rendered. New marks are installed only if the buffer did not change since the snapshot.
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool initialized;
+    int notify[2];
+    Editor *editor;
+    char *file_path;
+    char *data;
+    size_t size;
+    size_t generation;
+    size_t rows;
+    bool fetch;
+    Git_Gutter gutter;
+    Hashes scratch;
+} Git_Job;
+
+void *git_job_worker(void *arg)
+{
+    Git_Job *j = arg;
+    Git_Gutter *g = &j->gutter;
+    if (j->fetch) {
+        Data head = {0};
+        g->fetched = true;
+        g->tracked = git_show_head(j->file_path, &head);
+        hash_data_lines(head.items, head.count, &g->head);
+        free(head.items);
+        // The old matches are against the old HEAD
+        g->lines.count = 0;
+        g->matches.count = 0;
+    }
+    if (g->tracked) {
+        hash_data_lines(j->data, j->size, &j->scratch);
+        size_t first, old_end, new_end;
+        hashes_changed_range(&g->lines, &j->scratch, &first, &old_end, &new_end);
+        Hashes old = g->lines;
+        g->lines = j->scratch;
+        j->scratch = old;
+        size_t head_count = g->head.count;
+        diff_update(&g->matches, &g->head, &g->lines, head_count, head_count, head_count, first, old_end, new_end);
+        git_gutter_mark(g, j->rows);
+    }
+    UNUSED(write(j->notify[1], "g", 1));
+    return NULL;
+}
+
+bool editor_git_stale(const Editor *e)
+{
+    if (e->scratch || e->pending != NULL) return false;
+    if (!e->git.fetched || e->git.saved_generation != e->saved_generation) return true;
+    return e->git.tracked && e->git.generation != e->generation;
+}
+
+bool git_job_start(Git_Job *j, Editor *e)
+{
+    if (j->running) return false;
+    if (!j->initialized) {
+        if (pipe(j->notify) < 0) return false;
+        for (size_t i = 0; i < 2; ++i) {
+            fcntl(j->notify[i], F_SETFL, fcntl(j->notify[i], F_GETFL) | O_NONBLOCK);
+            fcntl(j->notify[i], F_SETFD, FD_CLOEXEC);
+        }
+        j->initialized = true;
+    }
+
+    j->editor = e;
+    j->fetch = !e->git.fetched || e->git.saved_generation != e->saved_generation;
+    j->generation = e->generation;
+    j->rows = e->lines.count;
+    j->size = e->data.count;
+    j->data = malloc(j->size + 1);
+    ASSERT(j->data != NULL, "Buy more RAM lol");
+    memcpy(j->data, e->data.items, j->size);
+    j->file_path = strdup(e->file_path);
+    ASSERT(j->file_path != NULL, "Buy more RAM lol");
+
+    // Everything but the marks moves into the job
+    Data marks = e->git.marks;
+    j->gutter = e->git;
+    j->gutter.marks = (Data) {0};
+    e->git = (Git_Gutter) {
+        .fetched = j->gutter.fetched,
+        .tracked = j->gutter.tracked,
+        .saved_generation = j->gutter.saved_generation,
+        .marks = marks,
+        .generation = j->gutter.generation,
+    };
+    if (j->fetch) j->gutter.saved_generation = e->saved_generation;
+
+    if (pthread_create(&j->thread, NULL, git_job_worker, j) != 0) {
+        free(j->data);
+        free(j->file_path);
+        j->data = NULL;
+        j->file_path = NULL;
+        marks = e->git.marks;
+        e->git = j->gutter;
+        e->git.marks = marks;
+        j->gutter = (Git_Gutter) {0};
+        return false;
+    }
+    j->running = true;
+    return true;
+}
+
+void git_job_finish(Git_Job *j)
+{
+    if (!j->running) return;
+    pthread_join(j->thread, NULL);
+    j->running = false;
+    char drain[16];
+    while (read(j->notify[0], drain, sizeof(drain)) > 0) {}
+    free(j->data);
+    free(j->file_path);
+    j->data = NULL;
+    j->file_path = NULL;
+
+    Editor *e = j->editor;
+    Data marks = e->git.marks;
+    size_t generation = e->git.generation;
+    e->git = j->gutter;
+    j->gutter = (Git_Gutter) {0};
+    if (e->generation == j->generation) {
+        free(marks.items);
+        e->git.generation = j->generation;
+    } else {
+        // Stale, the buffer is diffed again from the state of the snapshot
+        free(e->git.marks.items);
+        e->git.marks = marks;
+        e->git.generation = generation;
+    }
+}
+
+void git_job_free(Git_Job *j)
+{
+    git_job_finish(j);
+    if (j->initialized) {
+        close(j->notify[0]);
+        close(j->notify[1]);
+    }
+    free(j->scratch.items);
+    *j = (Git_Job) {0};
+}
+
+// Paths of all the files under the current directory for the finder
+typedef struct {
+    uint64_t *items;
+    size_t count;
+    size_t capacity;
+} Char_Masks;
+
+typedef struct {
+    Data paths;       // Each path is terminated by \n
+    Data folded;      // The paths in lower case for the matching
+    Offsets begins;   // Where each path begins in `paths` and `folded`
+    Char_Masks masks; // Characters of each path, see char_mask()
+    Offsets names;    // Where the file name of each path begins
+    bool complete;    // The walk that collects the paths has finished
+} File_List;
+
+#define FINDER_MAX_SHOWN 10
+
+typedef struct {
+    size_t file;
+    int score;
+} Finder_Match;
+
+typedef struct {
+    Finder_Match *items;
+    size_t count;
+    size_t capacity;
+} Finder_Matches;
+
+typedef struct {
+    Data pattern;            // In lower case
+    Finder_Matches matches;  // All the files that match the pattern, in the order of the list
+    size_t top[FINDER_MAX_SHOWN]; // Indices of the best matches, the best one first
+    size_t top_count;
+    size_t selected;         // Index in `top`
+} Finder;
+
+void file_list_free(File_List *l)
+{
+    free(l->paths.items);
+    free(l->folded.items);
+    free(l->begins.items);
+    free(l->masks.items);
+    free(l->names.items);
+    *l = (File_List) {0};
+}
+
+// Bit of a lower case character in the set of the characters of a path. The letters
+// and the digits get their own bits, the rest share the remaining ones.
+uint64_t char_mask(unsigned char x)
+{
+    if ('a' <= x && x <= 'z') return 1ULL << (x - 'a');
+    if ('0' <= x && x <= '9') return 1ULL << (26 + x - '0');
+    return 1ULL << (36 + x%28);
+}
+
+// Appends the `path\n` results of the walk
+void file_list_append(File_List *l, const char *results, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (i == 0 || results[i - 1] == '\n') da_append(&l->begins, l->paths.count + i);
+    }
+    da_append_many(&l->paths, results, size);
+    da_reserve(&l->folded, l->paths.count);
+    uint64_t mask = 0;
+    size_t name = l->folded.count;
+    for (size_t i = 0; i < size; ++i) {
+        char x = tolower((unsigned char) results[i]);
+        l->folded.items[l->folded.count++] = x;
+        if (x == '\n') {
+            da_append(&l->masks, mask);
+            da_append(&l->names, name);
+            mask = 0;
+            name = l->folded.count;
+        } else {
+            mask |= char_mask(x);
+            if (x == '/') name = l->folded.count;
+        }
+    }
+}
+
+// Whether the fuzzy pattern is a subsequence of the path, and how good the match is.
+// Both are expected in lower case. The characters are found with memchr(),
+// which is vectorized by the libc. Matches at the beginnings of the words, in the file
+// name, and right after the previous match are rewarded, longer paths are punished.
+bool fuzzy_match(const char *pattern, size_t pattern_size, const char *path, size_t path_size, size_t name_begin, int *score)
+{
+    const char *end = path + path_size;
+    const char *name = path + name_begin;
+    int result = 0;
+    const char *p = path;
+    const char *prev = NULL;
+    for (size_t i = 0; i < pattern_size; ++i) {
+        p = memchr(p, pattern[i], end - p);
+        if (p == NULL) return false;
+        result += 1;
+        if (p == path || p[-1] == '/' || p[-1] == '_' || p[-1] == '-' || p[-1] == '.' || p[-1] == ' ') result += 8;
+        if (p >= name) result += 2;
+        if (prev != NULL && p == prev + 1) result += 4;
+        prev = p;
+        p += 1;
+    }
+    *score = result*64 - (int) (path_size < 63 ? path_size : 63);
+    return true;
+}
+
+typedef struct {
+    const File_List *files;
+    const Finder_Match *candidates; // NULL means all the files
+    const char *pattern;
+    size_t pattern_size;
+    uint64_t pattern_mask;
+    Finder_Matches results[MAX_WORKERS];
+} Finder_Job;
+
+void finder_job(void *ctx, size_t worker, size_t begin, size_t end)
+{
+    Finder_Job *job = ctx;
+    const File_List *l = job->files;
+    for (size_t i = begin; i < end; ++i) {
+        size_t file = job->candidates ? job->candidates[i].file : i;
+        // Most of the paths miss some character of the pattern altogether
+        if (job->pattern_mask & ~l->masks.items[file]) continue;
+        size_t path_begin = l->begins.items[file];
+        size_t path_end = file + 1 < l->begins.count ? l->begins.items[file + 1] - 1 : l->paths.count - 1;
+        int score;
+        size_t name_begin = l->names.items[file] - path_begin;
+        if (fuzzy_match(job->pattern, job->pattern_size, l->folded.items + path_begin, path_end - path_begin, name_begin, &score)) {
+            Finder_Match match = { .file = file, .score = score };
+            da_append(&job->results[worker], match);
+        }
+    }
+}
+
+// Matches the files against the pattern. When the pattern extends the previous one,
+// which is what typing does, only the previous matches are checked again.
+void finder_update(Finder *f, const File_List *files, const char *pattern, size_t pattern_size, bool files_changed)
+{
+    Finder_Job job = { .files = files };
+    size_t count = files->begins.count;
+    bool narrowing = !files_changed && f->pattern.count > 0 && pattern_size >= f->pattern.count;
+    for (size_t i = 0; narrowing && i < f->pattern.count; ++i) {
+        narrowing = tolower((unsigned char) pattern[i]) == f->pattern.items[i];
+    }
+    Finder_Matches candidates = {0};
+    if (narrowing) {
+        candidates = f->matches;
+        f->matches = (Finder_Matches) {0};
+        job.candidates = candidates.items;
+        count = candidates.count;
+    }
+
+    f->pattern.count = 0;
+    for (size_t i = 0; i < pattern_size; ++i) {
+        da_append(&f->pattern, tolower((unsigned char) pattern[i]));
+    }
+    job.pattern = f->pattern.items;
+    job.pattern_size = f->pattern.count;
+    for (size_t i = 0; i < f->pattern.count; ++i) job.pattern_mask |= char_mask(f->pattern.items[i]);
+
+    f->matches.count = 0;
+    size_t workers = parallel_for(count, 16*1024, &job, finder_job);
+    for (size_t i = 0; i < workers; ++i) {
+        da_append_many(&f->matches, job.results[i].items, job.results[i].count);
+        free(job.results[i].items);
+    }
+    free(candidates.items);
+
+    // Insertion into the top sorted by the score, the earlier files win the ties
+    f->top_count = 0;
+    for (size_t i = 0; i < f->matches.count; ++i) {
+        int score = f->matches.items[i].score;
+        size_t j = f->top_count < FINDER_MAX_SHOWN ? f->top_count++ : FINDER_MAX_SHOWN;
+        while (j > 0 && f->matches.items[f->top[j - 1]].score < score) {
+            if (j < FINDER_MAX_SHOWN) f->top[j] = f->top[j - 1];
+            j -= 1;
+        }
+        if (j < FINDER_MAX_SHOWN) f->top[j] = i;
+    }
+    if (f->selected >= f->top_count) f->selected = 0;
+}
+
+typedef struct {
+    Buffers buffers;
+    // Settings of the newly opened buffers
+    size_t tab_width;
+    const char *time_format;
+    Tags tags;
+    Locations jumps; // Where the jumps to the definitions were made from
+    Marks marks;     // In the order they were made, that is how MARKS_PATH lists them
+    Walk grep;
+    // Kept in sync with the tree by watching all its directories with inotify(7)
+    Walk files_walk;
+    File_List files;
+    File_List files_next;
+    bool files_stale;
+    int inotify;
+    Finder finder;
+    Json_Build json_build;
+    Git_Job git_job;
+    Diff diff;
+    // Mapped session file that the pending buffers are loaded from
+    const char *session;
+    size_t session_size;
+    bool insert;
+    bool quit;
+    bool dry_run; // Nothing is saved, see editor_replay_input()
+    size_t esc_timeout_ms; // See Input
+    // Keys of the macro, each one stored as its length followed by its bytes
+    Data macro;
+    bool recording;
+    bool replaying;
+    bool replay_pending;
+    size_t replay_times; // 0 means until a key of the macro fails
+    Data replay_text;
+} Workspace;
+
+void workspace_free(Workspace *ws)
+{
+    // The background jobs write their results into the buffers
+    json_build_free(&ws->json_build);
+    git_job_free(&ws->git_job);
+    for (size_t i = 0; i < ws->buffers.count; ++i) {
+        editor_free_buffers(ws->buffers.items[i]);
+        free(ws->buffers.items[i]);
+    }
+    free(ws->buffers.items);
+    tags_close(&ws->tags);
+    free(ws->jumps.items);
+    for (size_t i = 0; i < ws->marks.count; ++i) free(ws->marks.items[i].name);
+    free(ws->marks.items);
+    walk_free(&ws->grep);
+    walk_free(&ws->files_walk);
+    diff_free(&ws->diff);
+    file_list_free(&ws->files);
+    file_list_free(&ws->files_next);
+    if (ws->inotify >= 0) close(ws->inotify);
+    free(ws->finder.pattern.items);
+    free(ws->finder.matches.items);
+    free(ws->macro.items);
+    free(ws->replay_text.items);
+    if (ws->session != NULL) munmap((void *) ws->session, ws->session_size);
+    *ws = (Workspace) { .inotify = -1 };
+}
+
+// Switches to the buffer of the file, opening it if needed. Without `must_exist` a file
+// that doesn't exist is opened as a new empty one.
+bool workspace_open_file(Workspace *ws, const char *file_path, bool must_exist)
+{
+    for (size_t i = 0; i < ws->buffers.count; ++i) {
+        if (strcmp(ws->buffers.items[i]->file_path, file_path) == 0) {
+            ws->buffers.current = i;
+            editor_load_pending(ws->buffers.items[i]);
+            return true;
+        }
+    }
+
+    Editor *e = calloc(1, sizeof(*e));
+    ASSERT(e != NULL, "Buy more RAM lol");
+    e->tab_width = ws->tab_width;
+    e->time_format = ws->time_format;
+    struct stat statbuf;
+    bool opened = false;
+    if (must_exist && stat(file_path, &statbuf) < 0) {
+        editor_set_status(e, "Could not open file %s: %s", file_path, strerror(errno));
+    } else {
+        opened = editor_open_file(e, file_path);
+    }
+    if (!opened) {
+        // The error goes to the buffer that is shown, or to stderr before there is one
+        if (ws->buffers.count > 0) {
+            Editor *current = ws->buffers.items[ws->buffers.current];
+            editor_set_status(current, "%.*s", (int) e->status.count, e->status.items);
+        } else {
+            fprintf(stderr, "ERROR: %.*s\n", (int) e->status.count, e->status.items);
+        }
+        editor_free_buffers(e);
+        free(e);
+        return false;
+    }
+    da_append(&ws->buffers, e);
+    ws->buffers.current = ws->buffers.count - 1;
+    return true;
+}
+
+// Moves the cursor to the address of a tag: a line number or a search pattern like
+// /^int main(void)$/
+void editor_goto_tag_address(Editor *e, const char *address, size_t size)
+{
+    if (size > 0 && isdigit((unsigned char) address[0])) {
+        size_t line = 0;
+        for (size_t i = 0; i < size && isdigit((unsigned char) address[i]); ++i) {
+            line = line*10 + address[i] - '0';
+        }
+        if (line > 0) line -= 1;
+        if (line >= e->lines.count) line = e->lines.count - 1;
+        e->cursor = e->lines.items[line].begin;
+        return;
+    }
+
+    if (size < 2 || (address[0] != '/' && address[0] != '?') || address[size - 1] != address[0]) return;
+    address += 1;
+    size -= 2;
+    bool line_begin = size > 0 && address[0] == '^';
+    if (line_begin) {
+        address += 1;
+        size -= 1;
+    }
+    bool line_end = size > 0 && address[size - 1] == '$' && (size < 2 || address[size - 2] != '\\');
+    if (line_end) size -= 1;
+
+    char pattern[1024];
+    size_t pattern_size = 0;
+    for (size_t i = 0; i < size && pattern_size < sizeof(pattern); ++i) {
+        if (address[i] == '\\' && i + 1 < size) i += 1;
+        pattern[pattern_size++] = address[i];
+    }
+
+    const char *data = e->data.items;
+    size_t offset = 0;
+    while (offset <= e->data.count) {
+        const char *found = memmem(data + offset, e->data.count - offset, pattern, pattern_size);
+        if (found == NULL) return;
+        size_t begin = found - data;
+        size_t end = begin + pattern_size;
+        if ((!line_begin || begin == 0 || data[begin - 1] == '\n') &&
+            (!line_end || end == e->data.count || data[end] == '\n')) {
+            e->cursor = begin;
+            return;
+        }
+        offset = begin + 1;
+    }
+}
+
+// Remembers the cursor of the buffer for workspace_jump_back()
+void workspace_push_jump(Workspace *ws, size_t buffer)
+{
+    Editor *e = ws->buffers.items[buffer];
+    size_t cursor = e->cursor <= e->data.count ? e->cursor : e->data.count;
+    Location from = { .buffer = buffer, .anchor = anchors_add(&e->anchors, cursor) };
+    da_append(&ws->jumps, from);
+}
+
+// Jumps to the definition of the word under the cursor according to the tags file
+void workspace_jump_to_definition(Workspace *ws)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    size_t begin = e->cursor < e->data.count ? e->cursor : e->data.count;
+    size_t end = begin;
+    while (begin > 0 && is_word_char(e->data.items[begin - 1])) begin -= 1;
+    while (end < e->data.count && is_word_char(e->data.items[end])) end += 1;
+    if (begin == end) return;
+
+    if (!tags_open(&ws->tags, TAGS_FILE_PATH)) {
+        editor_set_status(e, "No tags file");
+        return;
+    }
+    Tag tag;
+    if (!tags_find(&ws->tags, e->data.items + begin, end - begin, &tag)) {
+        editor_set_status(e, "Tag not found: %.*s", (int) (end - begin), e->data.items + begin);
+        return;
+    }
+
+    char file_path[PATH_MAX];
+    if (tag.file_size >= sizeof(file_path)) return;
+    memcpy(file_path, tag.file, tag.file_size);
+    file_path[tag.file_size] = '\0';
+
+    size_t from = ws->buffers.current;
+    if (!workspace_open_file(ws, file_path, true)) return;
+    workspace_push_jump(ws, from);
+    e = ws->buffers.items[ws->buffers.current];
+    editor_goto_tag_address(e, tag.address, tag.address_size);
+    editor_set_status(e, "%s:%zu", file_path, editor_current_line(e) + 1);
+}
+
+void workspace_jump_back(Workspace *ws)
+{
+    if (ws->jumps.count == 0) return;
+    Location from = ws->jumps.items[--ws->jumps.count];
+    ws->buffers.current = from.buffer;
+    Editor *e = ws->buffers.items[from.buffer];
+    editor_load_pending(e);
+    size_t cursor = anchors_get(&e->anchors, from.anchor);
+    anchors_remove(&e->anchors, from.anchor);
+    e->cursor = cursor <= e->data.count ? cursor : e->data.count;
+}
+
+// Buffer that is not backed by a file, like the results of the search
+Editor *workspace_open_scratch(Workspace *ws, const char *name)
+{
+    for (size_t i = 0; i < ws->buffers.count; ++i) {
+        Editor *e = ws->buffers.items[i];
+        if (e->scratch && strcmp(e->file_path, name) == 0) {
+            ws->buffers.current = i;
+            return e;
+        }
+    }
+
+    Editor *e = calloc(1, sizeof(*e));
+    ASSERT(e != NULL, "Buy more RAM lol");
+    e->tab_width = ws->tab_width;
+    e->time_format = ws->time_format;
+    e->scratch = true;
+    e->file_path = strdup(name);
+    ASSERT(e->file_path != NULL, "Buy more RAM lol");
+    editor_recompute_lines(e);
+    da_append(&ws->buffers, e);
+    ws->buffers.current = ws->buffers.count - 1;
+    return e;
+}
+
+void workspace_grep(Workspace *ws, const char *pattern, size_t pattern_size)
+{
+    if (pattern_size == 0) return;
+    Editor *e = workspace_open_scratch(ws, GREP_RESULTS_PATH);
+    editor_filter(e, NULL, 0);
+    e->folds.count = 0;
+    editor_splice(e, 0, e->data.count, NULL, 0);
+    e->cursor = 0;
+    if (!grep_start(&ws->grep, pattern, pattern_size)) {
+        editor_set_status(e, "Could not start the search: %s", strerror(errno));
+        return;
+    }
+    editor_set_status(e, "Searching for `%.*s`...", (int) pattern_size, pattern);
+}
+
+// Moves the results found by the workers so far to the end of the results buffer.
+// Called by the event loop when the workers poke it.
+void workspace_grep_poll(Workspace *ws)
+{
+    Walk *g = &ws->grep;
+    char drain[64];
+    while (read(g->notify[0], drain, sizeof(drain)) > 0) {}
+
+    pthread_mutex_lock(&g->lock);
+    Data results = g->results;
+    g->results = (Data) {0};
+    bool done = g->done;
+    size_t files = g->files;
+    size_t matches = g->matches;
+    pthread_mutex_unlock(&g->lock);
+
+    size_t current = ws->buffers.current;
+    Editor *e = workspace_open_scratch(ws, GREP_RESULTS_PATH);
+    ws->buffers.current = current;
+    editor_splice(e, e->data.count, 0, results.items, results.count);
+    free(results.items);
+
+    if (done) {
+        walk_stop(g);
+        editor_set_status(e, "%zu matches in %zu files", matches, files);
+    } else {
+        editor_set_status(e, "Searching... %zu matches in %zu files", matches, files);
+    }
+}
+
+// Jumps to the location of the `path:line:text` result under the cursor
+void workspace_open_grep_result(Workspace *ws)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    const Line *line = &e->lines.items[editor_current_line(e)];
+    const char *text = e->data.items + line->begin;
+    size_t size = line->end - line->begin;
+
+    // The path may contain colons itself, so look for the first `:<digits>:`
+    for (size_t i = 0; i < size; ++i) {
+        if (text[i] != ':') continue;
+        size_t j = i + 1;
+        while (j < size && isdigit((unsigned char) text[j])) j += 1;
+        if (j == i + 1 || j >= size || text[j] != ':') continue;
+
+        char file_path[PATH_MAX];
+        if (i >= sizeof(file_path)) return;
+        memcpy(file_path, text, i);
+        file_path[i] = '\0';
+        size_t from = ws->buffers.current;
+        if (!workspace_open_file(ws, file_path, true)) return;
+        workspace_push_jump(ws, from);
+        editor_goto_tag_address(ws->buffers.items[ws->buffers.current], text + i + 1, j - i - 1);
+        return;
+    }
+}
+
+void diff_append_lines(Data *out, char prefix, const Editor *e, size_t begin, size_t end)
+{
+    for (size_t row = begin; row < end; ++row) {
+        const Line *line = &e->lines.items[row];
+        da_append(out, prefix);
+        da_append_many(out, e->data.items + line->begin, line->end - line->begin);
+        da_append(out, '\n');
+        if (line->end == e->data.count) {
+            const char *note = "\\ No newline at end of file\n";
+            da_append_many(out, note, strlen(note));
+        }
+    }
+}
+
+typedef struct {
+    size_t a_begin, a_end;
+    size_t b_begin, b_end;
+} Diff_Change;
+
+typedef struct {
+    Diff_Change *items;
+    size_t count;
+    size_t capacity;
+} Diff_Changes;
+
+// Unified diff with DIFF_CONTEXT lines of context around the changes
+void diff_render(const Diff *d, Data *out, size_t *added, size_t *removed)
+{
+    const Editor *a = d->a.e;
+    const Editor *b = d->b.e;
+    size_t a_count = d->a.hashes.count;
+
+    // The changes are the gaps between the matches
+    Diff_Changes changes = {0};
+    size_t a_pos = 0;
+    size_t b_pos = 0;
+    for (size_t i = 0; i <= d->matches.count; ++i) {
+        Diff_Match x = i < d->matches.count
+            ? d->matches.items[i]
+            : (Diff_Match) { .a = a_count, .b = d->b.hashes.count };
+        if (x.a > a_pos || x.b > b_pos) {
+            da_append(&changes, ((Diff_Change) { .a_begin = a_pos, .a_end = x.a, .b_begin = b_pos, .b_end = x.b }));
+        }
+        a_pos = x.a + x.count;
+        b_pos = x.b + x.count;
+    }
+
+    *added = 0;
+    *removed = 0;
+    for (size_t i = 0; i < changes.count;) {
+        // The hunk takes all the following changes whose contexts touch
+        size_t j = i;
+        while (j + 1 < changes.count && changes.items[j + 1].a_begin - changes.items[j].a_end <= 2*DIFF_CONTEXT) j += 1;
+        const Diff_Change *first = &changes.items[i];
+        const Diff_Change *last = &changes.items[j];
+        // The context lines are the same on both sides
+        size_t a_begin = first->a_begin > DIFF_CONTEXT ? first->a_begin - DIFF_CONTEXT : 0;
+        size_t b_begin = first->b_begin - (first->a_begin - a_begin);
+        size_t a_end = last->a_end + DIFF_CONTEXT < a_count ? last->a_end + DIFF_CONTEXT : a_count;
+        size_t b_end = last->b_end + (a_end - last->a_end);
+
+        char header[128];
+        int n = snprintf(header, sizeof(header), "@@ -%zu,%zu +%zu,%zu @@\n",
+                         a_end > a_begin ? a_begin + 1 : a_begin, a_end - a_begin,
+                         b_end > b_begin ? b_begin + 1 : b_begin, b_end - b_begin);
+        da_append_many(out, header, n);
+
+        size_t pos = a_begin;
+        for (size_t k = i; k <= j; ++k) {
+            const Diff_Change *c = &changes.items[k];
+            diff_append_lines(out, ' ', a, pos, c->a_begin);
+            diff_append_lines(out, '-', a, c->a_begin, c->a_end);
+            diff_append_lines(out, '+', b, c->b_begin, c->b_end);
+            *removed += c->a_end - c->a_begin;
+            *added += c->b_end - c->b_begin;
+            pos = c->a_end;
+        }
+        diff_append_lines(out, ' ', a, pos, a_end);
+        i = j + 1;
+    }
+    free(changes.items);
+}
+
+// Brings the matches up to date with the edits of both sides and puts the diff into its
+// buffer. Does nothing if nothing changed since the last time.
+void workspace_diff_refresh(Workspace *ws, bool force)
+{
+    Diff *d = &ws->diff;
+    if (!d->active) return;
+
+    if (d->a.on_disk) {
+        // The file is saved when leaving Insert Mode, so it has to be watched too
+        struct stat statbuf;
+        if (stat(d->a.e->file_path, &statbuf) == 0 &&
+            (statbuf.st_mtim.tv_sec != d->a.mtime.tv_sec || statbuf.st_mtim.tv_nsec != d->a.mtime.tv_nsec)) {
+            d->a.mtime = statbuf.st_mtim;
+            // A file that can't be read anymore is compared as empty until it can
+            if (!editor_read_file(d->a.e, d->a.e->file_path)) d->a.e->data.count = 0;
+            editor_recompute_lines(d->a.e);
+            d->a.e->generation += 1;
+        }
+    }
+    if (!force && d->a.generation == d->a.e->generation && d->b.generation == d->b.e->generation) return;
+
+    Hashes scratch = {0};
+    size_t a_first, a_old_end, a_new_end;
+    size_t b_first, b_old_end, b_new_end;
+    diff_side_rehash(&d->a, &scratch, &a_first, &a_old_end, &a_new_end);
+    diff_side_rehash(&d->b, &scratch, &b_first, &b_old_end, &b_new_end);
+    free(scratch.items);
+    diff_update(&d->matches, &d->a.hashes, &d->b.hashes, a_first, a_old_end, a_new_end, b_first, b_old_end, b_new_end);
+
+    Data out = {0};
+    char header[PATH_MAX*2 + 64];
+    int n = snprintf(header, sizeof(header), "--- %s%s\n+++ %s\n",
+                     d->a.e->file_path, d->a.on_disk ? " (saved)" : "", d->b.e->file_path);
+    da_append_many(&out, header, n);
+    size_t added, removed;
+    diff_render(d, &out, &added, &removed);
+
+    size_t current = ws->buffers.current;
+    Editor *e = workspace_open_scratch(ws, DIFF_RESULTS_PATH);
+    ws->buffers.current = current;
+    size_t cursor = e->cursor;
+    editor_filter(e, NULL, 0);
+    e->folds.count = 0;
+    editor_splice(e, 0, e->data.count, out.items, out.count);
+    e->cursor = cursor <= e->data.count ? cursor : e->data.count;
+    free(out.items);
+    if (added == 0 && removed == 0) {
+        editor_set_status(e, "No differences");
+    } else {
+        editor_set_status(e, "+%zu -%zu lines", added, removed);
+    }
+}
+
+// Compares the current buffer with another buffer or, if there is none with that path,
+// with the file
+void workspace_diff(Workspace *ws, const char *path, size_t path_size)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    if (path_size == 0) return;
+    if (e->scratch && strcmp(e->file_path, DIFF_RESULTS_PATH) == 0) {
+        editor_set_status(e, "Can't diff the diff");
+        return;
+    }
+    char file_path[PATH_MAX];
+    if (path_size >= sizeof(file_path)) return;
+    memcpy(file_path, path, path_size);
+    file_path[path_size] = '\0';
+
+    Editor *other = NULL;
+    for (size_t i = 0; i < ws->buffers.count; ++i) {
+        Editor *b = ws->buffers.items[i];
+        if (b != e && strcmp(b->file_path, file_path) == 0) {
+            other = b;
+            break;
+        }
+    }
+
+    Diff_Side a = {0};
+    if (other != NULL) {
+        editor_load_pending(other);
+        a.e = other;
+    } else {
+        struct stat statbuf;
+        if (stat(file_path, &statbuf) < 0 || (statbuf.st_mode & S_IFMT) != S_IFREG) {
+            editor_set_status(e, "Could not read %s", file_path);
+            return;
+        }
+        a.e = calloc(1, sizeof(*a.e));
+        ASSERT(a.e != NULL, "Buy more RAM lol");
+        a.e->tab_width = ws->tab_width;
+        a.on_disk = true;
+        a.mtime = statbuf.st_mtim;
+        if (!editor_open_file(a.e, file_path)) {
+            diff_side_free(&a);
+            editor_set_status(e, "Could not read %s", file_path);
+            return;
+        }
+    }
+    if (editor_file_lines_count(a.e) >= UINT32_MAX || editor_file_lines_count(e) >= UINT32_MAX) {
+        diff_side_free(&a);
+        editor_set_status(e, "Too many lines to diff");
+        return;
+    }
+
+    diff_free(&ws->diff);
+    ws->diff = (Diff) { .active = true, .a = a, .b = { .e = e } };
+    workspace_diff_refresh(ws, true);
+    workspace_open_scratch(ws, DIFF_RESULTS_PATH)->cursor = 0;
+}
+
+// Jumps to the line of the new side under the cursor in the diff
+void workspace_open_diff_line(Workspace *ws)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    Diff *d = &ws->diff;
+    if (!d->active) return;
+
+    // Counting the lines of the new side from the header of the hunk
+    size_t row = editor_current_line(e);
+    size_t lines = 0;
+    for (size_t i = row + 1; i-- > 0;) {
+        const Line *line = &e->lines.items[i];
+        const char *text = e->data.items + line->begin;
+        size_t size = line->end - line->begin;
+        if (size >= 2 && text[0] == '@' && text[1] == '@') {
+            const char *plus = memchr(text, '+', size);
+            if (plus == NULL || i == row) return;
+            size_t start = strtoul(plus + 1, NULL, 10);
+            if (start > 0) start -= 1;
+            for (size_t k = 0; k < ws->buffers.count; ++k) {
+                if (ws->buffers.items[k] != d->b.e) continue;
+                workspace_push_jump(ws, ws->buffers.current);
+                ws->buffers.current = k;
+                Editor *b = d->b.e;
+                size_t target = start + lines;
+                if (target >= b->lines.count) target = b->lines.count - 1;
+                b->cursor = b->lines.items[target].begin;
+                return;
+            }
+            return;
+        }
+        if (i < row && size > 0 && text[0] != '-' && text[0] != '\\') lines += 1;
+    }
+}
+
+Mark *workspace_find_mark(Workspace *ws, const char *name, size_t name_size)
+{
+    for (size_t i = 0; i < ws->marks.count; ++i) {
+        Mark *mark = &ws->marks.items[i];
+        if (strlen(mark->name) == name_size && memcmp(mark->name, name, name_size) == 0) return mark;
+    }
+    return NULL;
+}
+
+// Puts the mark at the cursor, moving it there if the name is taken
+void workspace_set_mark(Workspace *ws, const char *name, size_t name_size)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    if (name_size == 0) return;
+    if (e->scratch && strcmp(e->file_path, MARKS_PATH) == 0) {
+        editor_set_status(e, "Can't mark the list of marks");
+        return;
+    }
+
+    Mark *mark = workspace_find_mark(ws, name, name_size);
+    if (mark != NULL) {
+        anchors_remove(&ws->buffers.items[mark->buffer]->anchors, mark->anchor);
+    } else {
+        Mark new_mark = { .name = strndup(name, name_size) };
+        ASSERT(new_mark.name != NULL, "Buy more RAM lol");
+        da_append(&ws->marks, new_mark);
+        mark = &ws->marks.items[ws->marks.count - 1];
+    }
+    size_t cursor = e->cursor <= e->data.count ? e->cursor : e->data.count;
+    mark->buffer = ws->buffers.current;
+    mark->anchor = anchors_add(&e->anchors, cursor);
+    editor_set_status(e, "Mark %s at line %zu", mark->name, editor_row_of(e, cursor) + 1);
+}
+
+void workspace_open_mark(Workspace *ws, size_t index)
+{
+    if (index >= ws->marks.count) return;
+    const Mark *mark = &ws->marks.items[index];
+    workspace_push_jump(ws, ws->buffers.current);
+    ws->buffers.current = mark->buffer;
+    Editor *e = ws->buffers.items[mark->buffer];
+    editor_load_pending(e);
+    size_t cursor = anchors_get(&e->anchors, mark->anchor);
+    e->cursor = cursor <= e->data.count ? cursor : e->data.count;
+}
+
+// Lists the marks as `name path:line: text`, one per line in the order of
+// Workspace.marks, so ENTER on a line jumps to its mark
+void workspace_list_marks(Workspace *ws)
+{
+    Data out = {0};
+    for (size_t i = 0; i < ws->marks.count; ++i) {
+        const Mark *mark = &ws->marks.items[i];
+        Editor *b = ws->buffers.items[mark->buffer];
+        size_t row = editor_row_of(b, anchors_get(&b->anchors, mark->anchor));
+        const Line *line = &b->lines.items[row];
+        size_t size = line->end - line->begin;
+        if (size > GREP_MAX_LINE_SIZE) size = GREP_MAX_LINE_SIZE;
+        data_appendf(&out, "%s %s:%zu: ", mark->name, b->file_path, row + 1);
+        da_append_many(&out, b->data.items + line->begin, size);
+        da_append(&out, '\n');
+    }
+
+    Editor *e = workspace_open_scratch(ws, MARKS_PATH);
+    editor_filter(e, NULL, 0);
+    e->folds.count = 0;
+    editor_splice(e, 0, e->data.count, out.items, out.count);
+    e->cursor = 0;
+    free(out.items);
+    editor_set_status(e, "%zu marks", ws->marks.count);
+}
+
+// Jumps to the mark with the name, nothing shows the list of the marks
+void workspace_goto_mark(Workspace *ws, const char *name, size_t name_size)
+{
+    if (name_size == 0) {
+        workspace_list_marks(ws);
+        return;
+    }
+    Mark *mark = workspace_find_mark(ws, name, name_size);
+    if (mark == NULL) {
+        editor_set_status(ws->buffers.items[ws->buffers.current], "No mark %.*s", (int) name_size, name);
+        return;
+    }
+    workspace_open_mark(ws, mark - ws->marks.items);
+}
+
+// Starts collecting the paths for the finder in the background. The first walk
+// fills the list right away, so the finder can show what is found so far, and the
+// refreshes collect a new list that replaces the old one when it is complete.
+void workspace_refresh_files(Workspace *ws)
+{
+    if (ws->files_walk.threads_count > 0) {
+        ws->files_stale = true;
+        return;
+    }
+    ws->files_stale = false;
+    if (ws->inotify < 0) ws->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    file_list_free(&ws->files_next);
+    if (!walk_start(&ws->files_walk, list_file, ws->inotify)) {
+        editor_set_status(ws->buffers.items[ws->buffers.current], "Could not list the files: %s", strerror(errno));
+    }
+}
+
+File_List *workspace_files_target(Workspace *ws)
+{
+    return ws->files.complete ? &ws->files_next : &ws->files;
+}
+
+void workspace_files_poll(Workspace *ws)
+{
+    Walk *w = &ws->files_walk;
+    char drain[64];
+    while (read(w->notify[0], drain, sizeof(drain)) > 0) {}
+
+    pthread_mutex_lock(&w->lock);
+    Data results = w->results;
+    w->results = (Data) {0};
+    bool done = w->done;
+    pthread_mutex_unlock(&w->lock);
+
+    File_List *target = workspace_files_target(ws);
+    file_list_append(target, results.items, results.count);
+    free(results.items);
+    if (!done) {
+        if (target != &ws->files) return;
+    } else {
+        walk_stop(w);
+        if (target == &ws->files_next) {
+            file_list_free(&ws->files);
+            ws->files = ws->files_next;
+            ws->files_next = (File_List) {0};
+        }
+        ws->files.complete = true;
+        if (ws->files_stale) workspace_refresh_files(ws);
+    }
+
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    if (e->prompt.kind == PROMPT_FIND_FILE) {
+        finder_update(&ws->finder, &ws->files, e->prompt.text.items, e->prompt.text.count, true);
+    }
+}
+
+// Something was created, deleted or renamed in one of the walked directories
+void workspace_inotify_poll(Workspace *ws)
+{
+    char events[4096];
+    while (read(ws->inotify, events, sizeof(events)) > 0) {}
+    workspace_refresh_files(ws);
+}
+
+void workspace_open_found_file(Workspace *ws)
+{
+    Finder *f = &ws->finder;
+    if (f->top_count == 0) return;
+    size_t file = f->matches.items[f->top[f->selected]].file;
+    const char *path = ws->files.paths.items + ws->files.begins.items[file];
+    const char *end = memchr(path, '\n', ws->files.paths.count - (path - ws->files.paths.items));
+
+    char file_path[PATH_MAX];
+    size_t size = end - path;
+    if (size >= sizeof(file_path)) return;
+    memcpy(file_path, path, size);
+    file_path[size] = '\0';
+    workspace_open_file(ws, file_path, true);
+}
+
+// List of the best matches of the finder right above the status row, the best one
+// at the bottom next to the prompt
+void display_render_finder(Display *d, const Workspace *ws)
+{
+    const Finder *f = &ws->finder;
+    // Nothing fits into a terminal that small, editor_rerender() gives up on it too
+    if (d->rows < 2 || d->cols < 2) return;
+    size_t rows = d->rows - 1;
+    for (size_t i = 0; i < f->top_count && i < rows; ++i) {
+        size_t row = rows - 1 - i;
+        size_t file = f->matches.items[f->top[i]].file;
+        const char *path = ws->files.paths.items + ws->files.begins.items[file];
+        const char *end = memchr(path, '\n', ws->files.paths.count - (path - ws->files.paths.items));
+        size_t size = end - path;
+        if (size > d->cols - 1) size = d->cols - 1;
+
+        memset(d->chars + row*d->cols, ' ', d->cols);
+        memcpy(d->chars + row*d->cols + 1, path, size);
+        memset(d->styles + row*d->cols, i == f->selected ? STYLE_POPUP_SELECTED : STYLE_POPUP, d->cols*sizeof(*d->styles));
+        d->ends[row] = d->cols;
+    }
+}
+
+// Saves the buffers that are backed by files. Written next to the session and
+// renamed over it, so a crash does not leave a broken session behind.
+bool workspace_save_session(const Workspace *ws, const char *file_path)
+{
+    bool result = true;
+    char tmp_path[PATH_MAX];
+    FILE *f = NULL;
+    if ((size_t) snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path) >= sizeof(tmp_path)) {
+        fprintf(stderr, "ERROR: session path %s is too long\n", file_path);
+        return_defer(false);
+    }
+    f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s for writing: %s\n", tmp_path, strerror(errno));
+        return_defer(false);
+    }
+
+    Session_Header header = {
+        .magic = SESSION_MAGIC,
+        .line_size = sizeof(Line),
+        .tab_size = sizeof(Tab),
+    };
+    for (size_t i = 0; i < ws->buffers.count; ++i) {
+        if (ws->buffers.items[i]->scratch) continue;
+        if (i == ws->buffers.current) header.current = header.buffers_count;
+        header.buffers_count += 1;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (size_t i = 0; i < ws->buffers.count; ++i) {
+        const Editor *e = ws->buffers.items[i];
+        if (e->scratch) continue;
+        // Buffers that were never looked at are saved as they were restored
+        if (e->pending) {
+            fwrite(e->pending, 1, session_buffer_size(e->pending), f);
+            continue;
+        }
+
+        Session_Buffer b = {
+            .path_size = strlen(e->file_path),
+            .cursor = e->cursor,
+            .view_row = e->view_row,
+            .view_col = e->view_col,
+            .tab_width = e->tab_width,
+        };
+        // Only the indices of the data that is in the file are of any use
+        struct stat statbuf;
+        if (e->generation == e->saved_generation && stat(e->file_path, &statbuf) == 0 && (size_t) statbuf.st_size == e->data.count) {
+            b.file_size = statbuf.st_size;
+            b.mtime_sec = statbuf.st_mtim.tv_sec;
+            b.mtime_nsec = statbuf.st_mtim.tv_nsec;
+            b.lines_count = e->lines.count;
+            b.tabs_count = e->tabs.count;
+        }
+        static const char padding[8] = {0};
+        fwrite(&b, sizeof(b), 1, f);
+        fwrite(e->file_path, 1, b.path_size, f);
+        fwrite(padding, 1, SESSION_ALIGN(b.path_size) - b.path_size, f);
+        fwrite(e->lines.items, sizeof(*e->lines.items), b.lines_count, f);
+        fwrite(e->tabs.items, sizeof(*e->tabs.items), b.tabs_count, f);
+    }
+
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: could not write into file %s: %s\n", tmp_path, strerror(errno));
+        return_defer(false);
+    }
+    if (fclose(f) != 0) {
+        f = NULL;
+        fprintf(stderr, "ERROR: could not write into file %s: %s\n", tmp_path, strerror(errno));
+        return_defer(false);
+    }
+    f = NULL;
+    if (rename(tmp_path, file_path) < 0) {
+        fprintf(stderr, "ERROR: could not rename %s to %s: %s\n", tmp_path, file_path, strerror(errno));
+        return_defer(false);
+    }
+
+defer:
+    if (f != NULL) fclose(f);
+    return result;
+}
+
+// Restores the buffers of the session. The session stays mapped into memory and
+// the buffers are only loaded from it when they are shown for the first time, so
+// restoring does not depend on how many files there are. Files that are gone are
+// skipped. A session that does not exist yet is not an error.
+bool workspace_restore_session(Workspace *ws, const char *file_path)
+{
+    bool result = true;
+    const char *session = MAP_FAILED;
+    size_t session_size = 0;
+
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return true;
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return_defer(false);
+    }
+    session_size = statbuf.st_size;
+    if (session_size < sizeof(Session_Header)) {
+        fprintf(stderr, "ERROR: %s is not a session file\n", file_path);
+        return_defer(false);
+    }
+    session = mmap(NULL, session_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (session == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map file %s: %s\n", file_path, strerror(errno));
+        return_defer(false);
+    }
+
+    const Session_Header *header = (const Session_Header *) session;
+    if (memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a session file\n", file_path);
+        return_defer(false);
+    }
+    if (header->line_size != sizeof(Line) || header->tab_size != sizeof(Tab)) {
+        fprintf(stderr, "ERROR: session %s was saved by an incompatible build\n", file_path);
         return_defer(false);
     }
-    ssize_t n = write(fd, e->data.items, e->data.count);
-    if (n < 0) {
-        fprintf(stderr, "ERROR: could not write into file %s: %s\n", file_path, strerror(errno));
-        return_defer(false);
+
+    size_t first_buffer = ws->buffers.count;
+    size_t current = first_buffer;
+    size_t offset = sizeof(*header);
+    for (uint64_t i = 0; i < header->buffers_count; ++i) {
+        const Session_Buffer *b = (const Session_Buffer *) (session + offset);
+        if (!session_buffer_fits(b, session_size - offset)) break;
+        offset += session_buffer_size(b);
+
+        char path[PATH_MAX];
+        memcpy(path, b + 1, b->path_size);
+        path[b->path_size] = '\0';
+        struct stat file_stat;
+        if (stat(path, &file_stat) < 0) continue;
+
+        Editor *e = calloc(1, sizeof(*e));
+        ASSERT(e != NULL, "Buy more RAM lol");
+        e->tab_width = ws->tab_width;
+        e->time_format = ws->time_format;
+        e->file_path = strdup(path);
+        ASSERT(e->file_path != NULL, "Buy more RAM lol");
+        e->pending = b;
+        // Keeps the editor usable until it is loaded
+        editor_recompute_lines(e);
+        da_append(&ws->buffers, e);
+        // The files that are gone are skipped, so the saved index of the current buffer
+        // may point further. It falls back to the closest buffer before it.
+        if (i <= header->current) current = ws->buffers.count - 1;
+    }
+
+    if (ws->buffers.count > first_buffer) {
+        ws->session = session;
+        ws->session_size = session_size;
+        session = MAP_FAILED;
+        ws->buffers.current = current;
+        editor_load_pending(ws->buffers.items[ws->buffers.current]);
+    }
+
+defer:
+    if (session != MAP_FAILED) munmap((void *) session, session_size);
+    close(fd);
+    return result;
+}
+
+// Self-pipe that turns SIGWINCH into an event for the event loop
+static int resize_pipe[2] = {-1, -1};
+
+void window_resize_signal(int signal)
+{
+    UNUSED(signal);
+    int saved_errno = errno;
+    UNUSED(write(resize_pipe[1], "", 1));
+    errno = saved_errno;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+}
+
+bool is_display(char x)
+{
+    return ' ' <= x && x <= '~';
+}
+
+void editor_move_char_right(Editor *e)
+{
+    if (e->cursor < e->data.count) e->cursor += 1;
+}
+
+void editor_move_char_left(Editor *e)
+{
+    if (e->cursor > 0) e->cursor -= 1;
+}
+
+void editor_move_line_down(Editor *e)
+{
+    size_t line = editor_current_line(e);
+    size_t column = e->cursor - e->lines.items[line].begin;
+    size_t prev;
+    if (editor_prev_visible_row(e, line, &prev)) {
+        e->cursor = e->lines.items[prev].begin + column;
+        if (e->cursor > e->lines.items[prev].end) {
+            e->cursor = e->lines.items[prev].end;
+        }
+    }
+}
+
+void editor_move_line_up(Editor *e)
+{
+    // TODO: preserve the column when moving up and down
+    // Right now if the next line is shorter the current column value is clamped and lost.
+    // Maybe cursor should be a pair (row, column) instead?
+    size_t line = editor_current_line(e);
+    size_t column = e->cursor - e->lines.items[line].begin;
+    size_t next;
+    if (editor_next_visible_row(e, line, &next)) {
+        e->cursor = e->lines.items[next].begin + column;
+        if (e->cursor > e->lines.items[next].end) {
+            e->cursor = e->lines.items[next].end;
+        }
     }
-    while ((size_t) n < e->data.count) {
-        ssize_t m = write(fd, e->data.items + n, e->data.count - n);
-        if (m < 0) {
-            fprintf(stderr, "ERROR: could not write into file %s: %s\n", file_path, strerror(errno));
-            return_defer(false);
+}
+
+void editor_move_word_left(Editor *e)
+{
+    while (0 < e->cursor && e->cursor < e->data.count && !isalnum(e->data.items[e->cursor])) {
+        e->cursor -= 1;
+    }
+    while (0 < e->cursor && e->cursor < e->data.count && isalnum(e->data.items[e->cursor])) {
+        e->cursor -= 1;
+    }
+}
+
+void editor_move_word_right(Editor *e)
+{
+    while (0 <= e->cursor && e->cursor < e->data.count - 1 && !isalnum(e->data.items[e->cursor])) {
+        e->cursor += 1;
+    }
+    while (0 <= e->cursor && e->cursor < e->data.count - 1 && isalnum(e->data.items[e->cursor])) {
+        e->cursor += 1;
+    }
+}
+
+void editor_move_paragraph_up(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    while ((e->lines.items[row].end - e->lines.items[row].begin) == 0 && editor_prev_visible_row(e, row, &row));
+    while ((e->lines.items[row].end - e->lines.items[row].begin) > 0 && editor_prev_visible_row(e, row, &row));
+    e->cursor = e->lines.items[row].begin;
+}
+
+void editor_move_paragraph_down(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    while ((e->lines.items[row].end - e->lines.items[row].begin) == 0 && editor_next_visible_row(e, row, &row));
+    while ((e->lines.items[row].end - e->lines.items[row].begin) > 0 && editor_next_visible_row(e, row, &row));
+    e->cursor = e->lines.items[row].begin;
+}
+
+void editor_move_to_buffer_start(Editor *e)
+{
+    e->cursor = 0;
+}
+
+void editor_move_to_buffer_end(Editor *e)
+{
+    e->cursor = e->data.count;
+}
+
+void editor_move_to_line_start(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    e->cursor = e->lines.items[row].begin;
+}
+
+void editor_move_to_line_end(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    e->cursor = e->lines.items[row].end;
+}
+
+// Jumps to the partner of the bracket under the cursor, or of the first bracket after
+// the cursor on the same line
+void editor_move_to_matching_bracket(Editor *e)
+{
+    const Line *line = &e->lines.items[editor_current_line(e)];
+    for (size_t i = e->cursor; i < line->end; ++i) {
+        bool opens;
+        if (bracket_kind(e->data.items[i], &opens) < 0) continue;
+        size_t partner;
+        if (editor_find_matching_bracket(e, i, &partner)) {
+            e->cursor = partner;
+        } else {
+            editor_set_status(e, "No matching bracket");
+        }
+        return;
+    }
+}
+
+// Moves to the beginning of the next field, or of the next row after the last field
+void editor_move_field_right(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    size_t count;
+    const size_t *delims = editor_row_delims(e, row, &count);
+    size_t o = e->cursor - e->lines.items[row].begin;
+    for (size_t k = 0; k < count; ++k) {
+        if (delims[k] >= o) {
+            e->cursor = e->lines.items[row].begin + delims[k] + 1;
+            return;
+        }
+    }
+    if (editor_next_visible_row(e, row, &row)) e->cursor = e->lines.items[row].begin;
+}
+
+// Moves to the beginning of the field, or of the previous one if already there
+void editor_move_field_left(Editor *e)
+{
+    size_t row = editor_current_line(e);
+    size_t o = e->cursor - e->lines.items[row].begin;
+    if (o == 0) {
+        if (!editor_prev_visible_row(e, row, &row)) return;
+        o = e->lines.items[row].end - e->lines.items[row].begin + 1;
+    }
+    size_t count;
+    const size_t *delims = editor_row_delims(e, row, &count);
+    size_t start = 0;
+    for (size_t k = 0; k < count && delims[k] + 1 < o; ++k) start = delims[k] + 1;
+    e->cursor = e->lines.items[row].begin + start;
+}
+
+bool parse_timestamp(const char *format, const char *str, size_t str_size, time_t *result)
+{
+    char buf[MAX_TIMESTAMP_LEN];
+    if (str_size >= sizeof(buf)) str_size = sizeof(buf) - 1;
+    memcpy(buf, str, str_size);
+    buf[str_size] = '\0';
+
+    struct tm tm = {0};
+    if (strptime(buf, format, &tm) == NULL) return false;
+    // Both the lines and the query are parsed the same way, so the time zone does not matter
+    *result = timegm(&tm);
+    return true;
+}
+
+// Finds the first line with the timestamp at or after `target`, assuming the timestamps
+// of the lines are sorted. Lines without a timestamp (like continuation lines of
+// multiline messages) are skipped. Takes O(log n) timestamp parses as long as such
+// lines are not too common.
+size_t editor_find_time(const Editor *e, time_t target, size_t *parses)
+{
+    size_t lo = 0;
+    size_t hi = e->lines.count;
+    *parses = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        size_t row = mid;
+        time_t time = 0;
+        for (; row < hi; ++row) {
+            const Line *line = &e->lines.items[row];
+            *parses += 1;
+            if (parse_timestamp(e->time_format, e->data.items + line->begin, line->end - line->begin, &time)) break;
+        }
+
+        if (row >= hi || time >= target) {
+            hi = mid;
+        } else {
+            lo = row + 1;
+        }
+    }
+
+    // We may have landed on a line without a timestamp before the actual line
+    for (; lo < e->lines.count; ++lo) {
+        const Line *line = &e->lines.items[lo];
+        time_t time;
+        *parses += 1;
+        if (parse_timestamp(e->time_format, e->data.items + line->begin, line->end - line->begin, &time)) break;
+    }
+    return lo;
+}
+
+void editor_start_prompt(Editor *e, Prompt_Kind kind, const char *label)
+{
+    e->prompt.kind = kind;
+    e->prompt.label = label;
+    e->prompt.text.count = 0;
+}
+
+void editor_submit_prompt(Editor *e)
+{
+    Prompt_Kind kind = e->prompt.kind;
+    e->prompt.kind = PROMPT_NONE;
+    const char *text = e->prompt.text.items;
+    int text_size = e->prompt.text.count;
+
+    switch (kind) {
+    case PROMPT_NONE:
+        break;
+
+    case PROMPT_FILTER: {
+        editor_filter(e, text, text_size);
+        if (!e->filter.active) break;
+        if (e->filter.rows.count == 0) {
+            editor_filter(e, NULL, 0);
+            editor_set_status(e, "No lines contain `%.*s`", text_size, text);
+            break;
+        }
+        // Land on the closest matching line below the cursor, or the last one
+        size_t i = rows_lower_bound(&e->filter.rows, editor_current_line(e));
+        if (i >= e->filter.rows.count) i = e->filter.rows.count - 1;
+        e->cursor = e->lines.items[e->filter.rows.items[i]].begin;
+    } break;
+
+    case PROMPT_JUMP_TO_TIME: {
+        time_t target;
+        if (!parse_timestamp(e->time_format, text, text_size, &target)) {
+            editor_set_status(e, "`%.*s` does not match the time format `%s`", text_size, text, e->time_format);
+            break;
+        }
+        size_t parses;
+        size_t row = editor_find_time(e, target, &parses);
+        if (row >= e->lines.count) {
+            editor_set_status(e, "Nothing at or after `%.*s` (%zu timestamps parsed)", text_size, text, parses);
+            break;
+        }
+        e->cursor = e->lines.items[row].begin;
+        editor_set_status(e, "Line %zu (%zu timestamps parsed)", row + 1, parses);
+    } break;
+
+    case PROMPT_GREP:
+    case PROMPT_FIND_FILE:
+    case PROMPT_REPLAY:
+    case PROMPT_DIFF:
+    case PROMPT_MARK:
+    case PROMPT_GOTO_MARK:
+        // Need the whole workspace, see workspace_handle_prompt_key()
+        break;
+    }
+}
+
+void editor_handle_prompt_key(Editor *e, const char *seq, size_t seq_len)
+{
+    if (strcmp(seq, ES_ESCAPE) == 0) {
+        e->prompt.kind = PROMPT_NONE;
+    } else if (strcmp(seq, ES_BACKSPACE) == 0) {
+        if (e->prompt.text.count > 0) e->prompt.text.count -= 1;
+    } else if (strcmp(seq, "\n") == 0) {
+        editor_submit_prompt(e);
+    } else if (seq_len == 1 && is_display(seq[0])) {
+        da_append(&e->prompt.text, seq[0]);
+    }
+}
+
+void workspace_handle_prompt_key(Workspace *ws, const char *seq, size_t seq_len)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    if (e->prompt.kind == PROMPT_GREP && strcmp(seq, "\n") == 0) {
+        e->prompt.kind = PROMPT_NONE;
+        workspace_grep(ws, e->prompt.text.items, e->prompt.text.count);
+        return;
+    }
+    if (e->prompt.kind == PROMPT_FIND_FILE) {
+        Finder *f = &ws->finder;
+        if (strcmp(seq, "\n") == 0) {
+            e->prompt.kind = PROMPT_NONE;
+            workspace_open_found_file(ws);
+        } else if (strcmp(seq, ES_CTRL_N) == 0) {
+            if (f->top_count > 0) f->selected = (f->selected + 1)%f->top_count;
+        } else if (strcmp(seq, ES_CTRL_P) == 0) {
+            if (f->top_count > 0) f->selected = (f->selected + f->top_count - 1)%f->top_count;
+        } else {
+            editor_handle_prompt_key(e, seq, seq_len);
+            if (e->prompt.kind == PROMPT_FIND_FILE) {
+                finder_update(f, &ws->files, e->prompt.text.items, e->prompt.text.count, false);
+            }
+        }
+        return;
+    }
+    if (e->prompt.kind == PROMPT_DIFF && strcmp(seq, "\n") == 0) {
+        e->prompt.kind = PROMPT_NONE;
+        workspace_diff(ws, e->prompt.text.items, e->prompt.text.count);
+        return;
+    }
+    if (e->prompt.kind == PROMPT_MARK && strcmp(seq, "\n") == 0) {
+        e->prompt.kind = PROMPT_NONE;
+        workspace_set_mark(ws, e->prompt.text.items, e->prompt.text.count);
+        return;
+    }
+    if (e->prompt.kind == PROMPT_GOTO_MARK && strcmp(seq, "\n") == 0) {
+        e->prompt.kind = PROMPT_NONE;
+        workspace_goto_mark(ws, e->prompt.text.items, e->prompt.text.count);
+        return;
+    }
+    if (e->prompt.kind == PROMPT_REPLAY && strcmp(seq, "\n") == 0) {
+        e->prompt.kind = PROMPT_NONE;
+        // Nothing means until failure
+        size_t times = 0;
+        for (size_t i = 0; i < e->prompt.text.count; ++i) {
+            char x = e->prompt.text.items[i];
+            if (!isdigit(x) || times > (SIZE_MAX - 9)/10) {
+                editor_set_status(e, "`%.*s` is not a number of times", (int) e->prompt.text.count, e->prompt.text.items);
+                return;
+            }
+            times = times*10 + x - '0';
+        }
+        if (e->prompt.text.count > 0 && times == 0) return;
+        ws->replay_pending = true;
+        ws->replay_times = times;
+        return;
+    }
+    editor_handle_prompt_key(e, seq, seq_len);
+}
+
+void workspace_start_finder(Workspace *ws)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    editor_start_prompt(e, PROMPT_FIND_FILE, "Find file: ");
+    if (!ws->files.complete && ws->files_walk.threads_count == 0) workspace_refresh_files(ws);
+    ws->finder.selected = 0;
+    finder_update(&ws->finder, &ws->files, NULL, 0, true);
+}
+
+void workspace_toggle_recording(Workspace *ws)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    if (ws->replaying) return;
+    if (ws->recording) {
+        ws->recording = false;
+        editor_set_status(e, "Recorded %zu bytes of keys", ws->macro.count);
+    } else {
+        ws->recording = true;
+        ws->macro.count = 0;
+        editor_set_status(e, "Recording the macro...");
+    }
+}
+
+// The keys of the macros and of the replayed input must not depend on how fast the index
+// is built, so they wait for it
+void workspace_sync_json(Workspace *ws, Editor *e)
+{
+    if (!(ws->replaying || ws->dry_run) || !editor_json_stale(e)) return;
+    if (ws->json_build.running && ws->json_build.editor != e) json_build_finish(&ws->json_build);
+    if (!ws->json_build.running) json_build_start(&ws->json_build, e);
+    json_build_finish(&ws->json_build);
+}
+
+void workspace_dispatch_key(Workspace *ws, const char *seq, size_t seq_len)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    if (e->prompt.kind != PROMPT_NONE) {
+        workspace_handle_prompt_key(ws, seq, seq_len);
+    } else if (ws->insert) {
+        if (strcmp(seq, ES_CTRL_N) == 0) {
+            Completion *c = &e->completion;
+            if (c->active) {
+                editor_select_completion(e, (c->selected + 1)%(c->count + 1));
+            } else {
+                editor_start_completion(e, &ws->buffers, false);
+            }
+            return;
+        }
+        if (strcmp(seq, ES_CTRL_P) == 0) {
+            Completion *c = &e->completion;
+            if (c->active) {
+                editor_select_completion(e, (c->selected + c->count)%(c->count + 1));
+            } else {
+                editor_start_completion(e, &ws->buffers, true);
+            }
+            return;
+        }
+        // Any other key accepts the completion
+        e->completion.active = false;
+
+        if (strcmp(seq, "\x1b ") == 0 || strcmp(seq, ES_ESCAPE) == 0) {
+            ws->insert = false;
+            // Replaying saves once at the end, see workspace_replay_macro()
+            if (!e->scratch && !ws->replaying && !ws->dry_run) editor_save_to_file(e, e->file_path);
+        } else if (strcmp(seq, ES_BACKSPACE) == 0) {
+            editor_backdelete_char(e);
+        } else if (strcmp(seq, ES_DELETE) == 0) {
+            editor_delete_char(e);
+        } else if (strcmp(seq, "\n") == 0) {
+            editor_insert_char(e, '\n');
+        } else if (seq_len == 1 && is_display(seq[0])) {
+            editor_insert_char(e, seq[0]);
+        }
+    } else {
+        if (strcmp(seq, "q") == 0) {
+            ws->quit = true;
+        } else if (strcmp(seq, ES_ESCAPE" ") == 0 || strcmp(seq, " ") == 0) {
+            ws->insert = true;
+        } else if (strcmp(seq, "s") == 0) {
+            editor_move_line_up(e);
+        } else if (strcmp(seq, "w") == 0) {
+            editor_move_line_down(e);
+        } else if (strcmp(seq, "a") == 0) {
+            editor_move_char_left(e);
+        } else if (strcmp(seq, "d") == 0) {
+            editor_move_char_right(e);
+        } else if (strcmp(seq, "k") == 0) {
+            editor_move_word_left(e);
+        } else if (strcmp(seq, ";") == 0) {
+            editor_move_word_right(e);
+        } else if (strcmp(seq, "o") == 0) {
+            editor_move_paragraph_up(e);
+        } else if (strcmp(seq, "l") == 0) {
+            editor_move_paragraph_down(e);
+        } else if (strcmp(seq, "O") == 0) {
+            editor_move_to_buffer_start(e);
+        } else if (strcmp(seq, "L") == 0) {
+            editor_move_to_buffer_end(e);
+        } else if (strcmp(seq, "K") == 0) {
+            editor_move_to_line_start(e);
+        } else if (strcmp(seq, ":") == 0) {
+            editor_move_to_line_end(e);
+        } else if (strcmp(seq, ES_CTRL_RIGHT_BRACKET) == 0) {
+            workspace_jump_to_definition(ws);
+        } else if (strcmp(seq, ES_CTRL_T) == 0) {
+            workspace_jump_back(ws);
+        } else if (strcmp(seq, "%") == 0) {
+            editor_move_to_matching_bracket(e);
+        } else if (strcmp(seq, "f") == 0) {
+            editor_start_prompt(e, PROMPT_FILTER, "Filter: ");
+            da_append_many(&e->prompt.text, e->filter.pattern.items, e->filter.pattern.count);
+        } else if (strcmp(seq, "u") == 0) {
+            workspace_sync_json(ws, e);
+            editor_move_json_parent(e);
+        } else if (strcmp(seq, "n") == 0) {
+            workspace_sync_json(ws, e);
+            editor_move_json_next_sibling(e);
+        } else if (strcmp(seq, "p") == 0) {
+            workspace_sync_json(ws, e);
+            editor_move_json_prev_sibling(e);
+        } else if (strcmp(seq, "z") == 0) {
+            workspace_sync_json(ws, e);
+            editor_toggle_fold(e);
+        } else if (strcmp(seq, "Z") == 0) {
+            e->folds.count = 0;
+        } else if (strcmp(seq, "S") == 0) {
+            editor_sort_lines(e);
+        } else if (strcmp(seq, "U") == 0) {
+            editor_uniq_lines(e);
+        } else if (strcmp(seq, "=") == 0) {
+            editor_show_stats(e);
+        } else if (strcmp(seq, "c") == 0) {
+            editor_toggle_columns(e);
+        } else if (strcmp(seq, "]") == 0 && e->columns.active) {
+            editor_move_field_right(e);
+        } else if (strcmp(seq, "[") == 0 && e->columns.active) {
+            editor_move_field_left(e);
+        } else if (strcmp(seq, "e") == 0) {
+            workspace_start_finder(ws);
+        } else if (strcmp(seq, "g") == 0) {
+            editor_start_prompt(e, PROMPT_GREP, "Grep: ");
+        } else if (strcmp(seq, "\n") == 0 && e->scratch && strcmp(e->file_path, GREP_RESULTS_PATH) == 0) {
+            workspace_open_grep_result(ws);
+        } else if (strcmp(seq, "D") == 0) {
+            editor_start_prompt(e, PROMPT_DIFF, "Diff with: ");
+        } else if (strcmp(seq, "m") == 0) {
+            editor_start_prompt(e, PROMPT_MARK, "Mark: ");
+        } else if (strcmp(seq, "'") == 0) {
+            editor_start_prompt(e, PROMPT_GOTO_MARK, "Go to mark: ");
+        } else if (strcmp(seq, "\n") == 0 && e->scratch && strcmp(e->file_path, MARKS_PATH) == 0) {
+            workspace_open_mark(ws, editor_current_line(e));
+        } else if (strcmp(seq, "\n") == 0 && e->scratch && strcmp(e->file_path, DIFF_RESULTS_PATH) == 0) {
+            workspace_open_diff_line(ws);
+        } else if (strcmp(seq, "M") == 0) {
+            workspace_toggle_recording(ws);
+        } else if (strcmp(seq, "@") == 0) {
+            if (ws->recording) {
+                editor_set_status(e, "Can't replay the macro while recording it");
+            } else if (!ws->replaying) {
+                editor_start_prompt(e, PROMPT_REPLAY, "Replay times: ");
+                da_append(&e->prompt.text, '1');
+            }
+        } else if (strcmp(seq, "t") == 0) {
+            editor_start_prompt(e, PROMPT_JUMP_TO_TIME, "Jump to time: ");
+        } else if (strcmp(seq, ES_DELETE) == 0) {
+            editor_delete_char(e);
+        } else if (strcmp(seq, ES_BACKSPACE) == 0) {
+            editor_backdelete_char(e);
+        } else if (strcmp(seq, "\n") == 0) {
+            editor_insert_char(e, '\n');
+        }
+    }
+}
+
+// Returns false if the key did not change anything, which stops the macros replayed until failure
+bool workspace_handle_key(Workspace *ws, const char *seq, size_t seq_len)
+{
+    Editor *e = ws->buffers.items[ws->buffers.current];
+    size_t current = ws->buffers.current;
+    size_t cursor = e->cursor;
+    size_t generation = e->generation;
+    size_t folds_count = e->folds.count;
+    Prompt_Kind prompt = e->prompt.kind;
+    bool insert = ws->insert;
+    bool recording = ws->recording && !ws->replaying;
+
+    e->status.count = 0;
+    workspace_dispatch_key(ws, seq, seq_len);
+
+    // The key that stops the recording is not part of the macro
+    if (recording && ws->recording) {
+        ASSERT(seq_len < 256, "The length of the key must fit into a byte");
+        da_append(&ws->macro, (char) seq_len);
+        da_append_many(&ws->macro, seq, seq_len);
+    }
+
+    if (prompt != PROMPT_NONE) return true;
+    return ws->buffers.current != current
+        || e->cursor != cursor
+        || e->generation != generation
+        || e->folds.count != folds_count
+        || e->prompt.kind != prompt
+        || ws->insert != insert
+        || ws->quit;
+}
+
+#define REPLAY_INTERRUPT_CHECK_KEYS 1024
+
+bool replay_is_text_key(const char *seq, size_t seq_len)
+{
+    return seq_len == 1 && (is_display(seq[0]) || seq[0] == '\n');
+}
+
+// Replays the macro ws->replay_times times, or until one of its keys fails. Nothing is
+// rendered in between, the event loop renders only the final state.
+void workspace_replay_macro(Workspace *ws)
+{
+    ws->replay_pending = false;
+    if (ws->macro.count == 0) {
+        editor_set_status(ws->buffers.items[ws->buffers.current], "No macro is recorded. Press M to record one.");
+        return;
+    }
+
+    uint64_t begin = now_ns();
+    size_t replayed = 0;
+    size_t keys = 0;
+    size_t next_check = REPLAY_INTERRUPT_CHECK_KEYS;
+    bool stop = false;
+    // Otherwise stdin may be just a file that is always readable
+    bool interruptible = isatty(STDIN_FILENO);
+    ws->replaying = true;
+    while (!stop && !ws->quit && (ws->replay_times == 0 || replayed < ws->replay_times)) {
+        size_t i = 0;
+        while (i < ws->macro.count) {
+            Editor *e = ws->buffers.items[ws->buffers.current];
+            const char *seq = &ws->macro.items[i + 1];
+            size_t seq_len = (unsigned char) ws->macro.items[i];
+
+            if (ws->insert && e->prompt.kind == PROMPT_NONE && replay_is_text_key(seq, seq_len)) {
+                // Each splice is linear in the size of the buffer, so the typed text goes in at once
+                ws->replay_text.count = 0;
+                while (i < ws->macro.count && replay_is_text_key(&ws->macro.items[i + 1], (unsigned char) ws->macro.items[i])) {
+                    da_append(&ws->replay_text, ws->macro.items[i + 1]);
+                    i += 2;
+                }
+                e->completion.active = false;
+                e->status.count = 0;
+                editor_insert_text(e, ws->replay_text.items, ws->replay_text.count);
+                keys += ws->replay_text.count;
+            } else {
+                char key[MAX_ESC_SEQ_LEN] = {0};
+                memcpy(key, seq, seq_len);
+                keys += 1;
+                if (!workspace_handle_key(ws, key, seq_len)) {
+                    stop = true;
+                    break;
+                }
+                i += 1 + seq_len;
+            }
+
+            // Any key pressed in the meantime interrupts the replay
+            if (interruptible && keys >= next_check) {
+                next_check = keys + REPLAY_INTERRUPT_CHECK_KEYS;
+                struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+                if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+                    char drain[MAX_ESC_SEQ_LEN];
+                    UNUSED(read(STDIN_FILENO, drain, sizeof(drain)));
+                    stop = true;
+                    break;
+                }
+            }
+        }
+        if (i >= ws->macro.count) replayed += 1;
+    }
+    ws->replaying = false;
+
+    // The keys leaving Insert Mode don't save the buffers while replaying
+    if (!ws->insert && !ws->dry_run) {
+        for (size_t i = 0; i < ws->buffers.count; ++i) {
+            Editor *b = ws->buffers.items[i];
+            if (!b->scratch && b->pending == NULL && b->generation != b->saved_generation) {
+                editor_save_to_file(b, b->file_path);
+            }
+        }
+    }
+
+    uint64_t elapsed = now_ns() - begin;
+    editor_set_status(ws->buffers.items[ws->buffers.current], "Replayed %zu times, %zu keys in %.3fms", replayed, keys, elapsed/1e6);
+}
+
+typedef enum {
+    COLOR_DEPTH_16 = 0,
+    COLOR_DEPTH_256,
+    COLOR_DEPTH_TRUECOLOR,
+} Color_Depth;
+
+typedef struct {
+    // What the terminal told us about itself during terminal_probe()
+    int da1_class;     // Conformance level from DA1 (e.g. 62 for VT220). 0 if unknown.
+    int da2_type;      // Terminal type from DA2. -1 if unknown.
+    int da2_version;   // Firmware version from DA2. -1 if unknown.
+    char name[64];     // XTVERSION reply (e.g. "XTerm(380)"). Empty if unknown.
+    bool late_replies; // DA1 did not arrive in time, so the replies may still come with the input
+
+    // Capabilities that the output encoder specializes on
+    bool sync_output;  // DEC private mode 2026, frames are wrapped in BSU/ESU
+    bool rep;          // REP (CSI Pn b) repeats the preceding character
+    bool ech;          // ECH (CSI Pn X) erases characters without moving the cursor
+    Color_Depth color_depth;
+
+    // Progressive keyboard enhancement of kitty (CSI ? u). With it the terminal sends the
+    // Escape key and the ambiguous modifier combos as CSI code;modifiers u.
+    bool csi_u;
+} Terminal;
+
+#define TERMINAL_PROBE_TIMEOUT_MS 200
+#define TERMINAL_PROBE_MAX_REPLY 512
+
+// Terminals that are known to implement REP. There is no query for REP, so we
+// have to identify the terminal by its XTVERSION reply.
+static const char *terminals_with_rep[] = {
+    "XTerm(",
+    "kitty(",
+    "foot(",
+    "WezTerm ",
+    "contour ",
+};
+
+void terminal_parse_replies(Terminal *t, const char *buf, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        if (buf[i] != '\033' || i + 1 >= n) {
+            i += 1;
+            continue;
+        }
+
+        if (buf[i + 1] == 'P') {
+            // DCS ... ST
+            size_t begin = i + 2;
+            size_t end = begin;
+            while (end + 1 < n && !(buf[end] == '\033' && buf[end + 1] == '\\')) end += 1;
+            if (end + 1 >= n) break;
+            const char *body = buf + begin;
+            size_t body_size = end - begin;
+            if (body_size >= 2 && memcmp(body, ">|", 2) == 0) {
+                // XTVERSION
+                size_t name_size = body_size - 2;
+                if (name_size >= sizeof(t->name)) name_size = sizeof(t->name) - 1;
+                memcpy(t->name, body + 2, name_size);
+                t->name[name_size] = '\0';
+            } else if (body_size >= 9 && memcmp(body, "1+r524742", 9) == 0) {
+                // XTGETTCAP reply confirming the "RGB" capability
+                t->color_depth = COLOR_DEPTH_TRUECOLOR;
+            }
+            i = end + 2;
+            continue;
+        }
+
+        if (buf[i + 1] == '[') {
+            // CSI [private] params [intermediate] final
+            size_t j = i + 2;
+            char private = 0;
+            if (j < n && (buf[j] == '?' || buf[j] == '>')) private = buf[j++];
+            int params[8] = {0};
+            size_t params_count = 0;
+            if (j < n && isdigit(buf[j])) params_count = 1;
+            for (; j < n && (isdigit(buf[j]) || buf[j] == ';'); ++j) {
+                if (buf[j] == ';') {
+                    if (params_count < sizeof(params)/sizeof(params[0])) params_count += 1;
+                } else if (params_count <= sizeof(params)/sizeof(params[0])) {
+                    params[params_count - 1] = params[params_count - 1]*10 + (buf[j] - '0');
+                }
+            }
+            char intermediate = 0;
+            if (j < n && buf[j] == '$') intermediate = buf[j++];
+            if (j >= n) break;
+            char final = buf[j];
+
+            if (private == '?' && intermediate == 0 && final == 'c') {
+                t->da1_class = params[0];
+            } else if (private == '>' && intermediate == 0 && final == 'c') {
+                t->da2_type = params[0];
+                t->da2_version = params_count >= 2 ? params[1] : -1;
+            } else if (private == '?' && intermediate == 0 && final == 'u') {
+                // The current flags of the progressive keyboard enhancement
+                t->csi_u = true;
+            } else if (private == '?' && intermediate == '$' && final == 'y' && params[0] == 2026) {
+                // DECRPM: 1 - set, 2 - reset, 0 - not recognized, 4 - permanently reset
+                t->sync_output = params[1] == 1 || params[1] == 2;
+            }
+            i = j + 1;
+            continue;
+        }
+
+        i += 1;
+    }
+}
+
+// Asks the terminal who it is and what it can do, and then picks the output
+// encoding based on the answers. Expects the terminal to be already in the
+// non-canonical mode without echo. Terminals that do not reply in time end up with
+// the most conservative encoding.
+void terminal_probe(Terminal *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->da2_type = -1;
+    t->da2_version = -1;
+
+    // Every terminal answers DA1, so it goes last and marks the end of the replies.
+    const char *queries =
+        "\033[>0q"          // XTVERSION
+        "\033[>c"           // DA2
+        "\033[?2026$p"      // DECRQM for the synchronized output mode
+        "\033P+q524742\033\\" // XTGETTCAP "RGB"
+        "\033[?u"           // Flags of the progressive keyboard enhancement
+        "\033[c";           // DA1
+    if (write(STDOUT_FILENO, queries, strlen(queries)) < 0) return;
+
+    char buf[TERMINAL_PROBE_MAX_REPLY];
+    size_t n = 0;
+    int timeout = TERMINAL_PROBE_TIMEOUT_MS;
+    bool da1_received = false;
+    while (!da1_received && n < sizeof(buf)) {
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) break;
+        ssize_t m = read(STDIN_FILENO, buf + n, sizeof(buf) - n);
+        if (m <= 0) break;
+        n += m;
+
+        // Look for the DA1 reply: CSI ? ... c
+        for (size_t i = 0; i + 2 < n && !da1_received; ++i) {
+            if (buf[i] == '\033' && buf[i + 1] == '[' && buf[i + 2] == '?') {
+                size_t j = i + 3;
+                while (j < n && (isdigit(buf[j]) || buf[j] == ';')) j += 1;
+                da1_received = j < n && buf[j] == 'c';
+            }
+        }
+    }
+
+    terminal_parse_replies(t, buf, n);
+    t->late_replies = !da1_received;
+
+    // ECH is part of VT220
+    t->ech = t->da1_class >= 62;
+    for (size_t i = 0; i < sizeof(terminals_with_rep)/sizeof(terminals_with_rep[0]); ++i) {
+        if (strncmp(t->name, terminals_with_rep[i], strlen(terminals_with_rep[i])) == 0) {
+            t->rep = true;
+            break;
+        }
+    }
+    // VTE (DA2 type 65) has REP since 0.52 (version 5200)
+    if (t->da2_type == 65 && t->da2_version >= 5200) t->rep = true;
+
+    if (t->color_depth != COLOR_DEPTH_TRUECOLOR) {
+        const char *colorterm = getenv("COLORTERM");
+        const char *term = getenv("TERM");
+        if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0)) {
+            t->color_depth = COLOR_DEPTH_TRUECOLOR;
+        } else if (term && strstr(term, "256color")) {
+            t->color_depth = COLOR_DEPTH_256;
+        } else {
+            t->color_depth = COLOR_DEPTH_16;
         }
-        n += m;
     }
-defer:
-    if (fd >= 0) UNUSED(close(fd));
-    return result;
 }
 
-void window_resize_signal(int signal)
+size_t count_digits(size_t x)
 {
-    UNUSED(signal);
+    size_t n = 1;
+    while (x >= 10) {
+        x /= 10;
+        n += 1;
+    }
+    return n;
 }
 
-bool is_display(char x)
+// `base` is 30 for the foreground and 40 for the background
+void terminal_encode_color(const Terminal *t, Data *out, const uint8_t rgb[3], unsigned base)
 {
-    return ' ' <= x && x <= '~';
+    uint8_t r = rgb[0], g = rgb[1], b = rgb[2];
+    switch (t->color_depth) {
+    case COLOR_DEPTH_TRUECOLOR:
+        data_appendf(out, ";%u;2;%u;%u;%u", base + 8, r, g, b);
+        break;
+    case COLOR_DEPTH_256:
+        // 6x6x6 color cube
+        data_appendf(out, ";%u;5;%u", base + 8, 16 + 36*((r*6)/256) + 6*((g*6)/256) + (b*6)/256);
+        break;
+    case COLOR_DEPTH_16:
+        // The closest of the 8 basic colors by thresholding each component
+        data_appendf(out, ";%u", base + (r >= 0x80) + 2*(g >= 0x80) + 4*(b >= 0x80));
+        break;
+    }
 }
 
-void editor_move_char_right(Editor *e)
+void terminal_encode_style(const Terminal *t, Data *out, Style style)
 {
-    if (e->cursor < e->data.count) e->cursor += 1;
+    const Style_Def *def = &style_defs[style];
+    data_append_cstr(out, "\033[0");
+    if (def->bold) data_append_cstr(out, ";1");
+    if (def->has_fg) terminal_encode_color(t, out, def->fg, 30);
+    if (def->has_bg) terminal_encode_color(t, out, def->bg, 40);
+    data_append_cstr(out, "m");
 }
 
-void editor_move_char_left(Editor *e)
+// Appends `n` copies of `x` using the cheapest encoding the terminal supports.
+// `at_row_end` tells that the run reaches the last column, so the position of the
+// cursor after the run does not matter.
+void terminal_encode_run(const Terminal *t, Data *out, char x, Style style, size_t n, bool at_row_end)
 {
-    if (e->cursor > 0) e->cursor -= 1;
+    size_t literal_cost = n;
+    size_t rep_cost = t->rep && is_display(x) && n > 1 ? 1 + 3 + count_digits(n - 1) : SIZE_MAX;
+    size_t ech_cost = SIZE_MAX;
+    if (t->ech && x == ' ' && style == STYLE_DEFAULT) {
+        ech_cost = 3 + count_digits(n);
+        if (!at_row_end) ech_cost += 3 + count_digits(n);
+    }
+
+    if (literal_cost <= rep_cost && literal_cost <= ech_cost) {
+        for (size_t i = 0; i < n; ++i) da_append(out, x);
+    } else if (rep_cost <= ech_cost) {
+        da_append(out, x);
+        data_appendf(out, "\033[%zub", n - 1);
+    } else {
+        data_appendf(out, "\033[%zuX", n);
+        if (!at_row_end) data_appendf(out, "\033[%zuC", n);
+    }
 }
 
-void editor_move_line_down(Editor *e)
+// Moves the cursor from (row, col) to (to_row, to_col) with the shortest sequence.
+// Use col == cols to indicate that the cursor is in the pending wrap state after
+// writing into the last column, in which case relative moves are unreliable.
+void terminal_encode_move(Data *out, size_t cols, size_t row, size_t col, size_t to_row, size_t to_col)
 {
-    size_t line = editor_current_line(e);
-    size_t column = e->cursor - e->lines.items[line].begin;
-    if (line > 0) {
-        e->cursor = e->lines.items[line - 1].begin + column;
-        if (e->cursor > e->lines.items[line - 1].end) {
-            e->cursor = e->lines.items[line - 1].end;
-        }
+    char absolute[64];
+    if (to_row == 0 && to_col == 0) {
+        snprintf(absolute, sizeof(absolute), "\033[H");
+    } else if (to_col == 0) {
+        snprintf(absolute, sizeof(absolute), "\033[%zuH", to_row + 1);
+    } else {
+        snprintf(absolute, sizeof(absolute), "\033[%zu;%zuH", to_row + 1, to_col + 1);
+    }
+
+    if (col >= cols) {
+        data_append_cstr(out, absolute);
+        return;
     }
+
+    char relative[64] = {0};
+    int n = 0;
+    if (to_row < row) {
+        n += to_row + 1 == row
+            ? snprintf(relative + n, sizeof(relative) - n, "\033[A")
+            : snprintf(relative + n, sizeof(relative) - n, "\033[%zuA", row - to_row);
+    } else if (to_row > row) {
+        n += to_row == row + 1
+            ? snprintf(relative + n, sizeof(relative) - n, "\033[B")
+            : snprintf(relative + n, sizeof(relative) - n, "\033[%zuB", to_row - row);
+    }
+    if (to_col == 0 && col > 0) {
+        n += snprintf(relative + n, sizeof(relative) - n, "\r");
+    } else if (to_col > col) {
+        n += to_col == col + 1
+            ? snprintf(relative + n, sizeof(relative) - n, "\033[C")
+            : snprintf(relative + n, sizeof(relative) - n, "\033[%zuC", to_col - col);
+    } else if (to_col < col) {
+        n += to_col + 1 == col
+            ? snprintf(relative + n, sizeof(relative) - n, "\b")
+            : snprintf(relative + n, sizeof(relative) - n, "\033[%zuD", col - to_col);
+    }
+
+    data_append_cstr(out, strlen(relative) < strlen(absolute) ? relative : absolute);
 }
 
-void editor_move_line_up(Editor *e)
+// Marks the cell as unknown, so the next display_flush() writes it no matter what.
+#define STYLE_UNKNOWN 0xFF
+
+void display_resize_to(Display *d, size_t rows, size_t cols)
 {
-    // TODO: preserve the column when moving up and down
-    // Right now if the next line is shorter the current column value is clamped and lost.
-    // Maybe cursor should be a pair (row, column) instead?
-    size_t line = editor_current_line(e);
-    size_t column = e->cursor - e->lines.items[line].begin;
-    if (line < e->lines.count - 1) {
-        e->cursor = e->lines.items[line + 1].begin + column;
-        if (e->cursor > e->lines.items[line + 1].end) {
-            e->cursor = e->lines.items[line + 1].end;
+    size_t old_rows = d->rows;
+    size_t old_cols = d->cols;
+    d->rows = rows;
+    d->cols = cols;
+
+    if (d->rows*d->cols > d->cells_capacity) {
+        d->cells_capacity = d->rows*d->cols;
+        d->chars = realloc(d->chars, d->cells_capacity*sizeof(*d->chars));
+        ASSERT(d->chars != NULL, "Buy more RAM lol");
+        d->styles = realloc(d->styles, d->cells_capacity*sizeof(*d->styles));
+        ASSERT(d->styles != NULL, "Buy more RAM lol");
+        d->prev_chars = realloc(d->prev_chars, d->cells_capacity*sizeof(*d->prev_chars));
+        ASSERT(d->prev_chars != NULL, "Buy more RAM lol");
+        d->prev_styles = realloc(d->prev_styles, d->cells_capacity*sizeof(*d->prev_styles));
+        ASSERT(d->prev_styles != NULL, "Buy more RAM lol");
+    }
+    if (d->rows > d->rows_capacity) {
+        d->rows_capacity = d->rows;
+        d->ends = realloc(d->ends, d->rows_capacity*sizeof(*d->ends));
+        ASSERT(d->ends != NULL, "Buy more RAM lol");
+    }
+
+    // When only the height changed the rows that the terminal kept on the screen are
+    // still valid, because the grid is stored row by row. The new rows at the bottom
+    // are unknown. If the cursor ended up below the new bottom, the terminal has scrolled
+    // the content to keep it visible and we can't trust anything.
+    if (d->has_prev_frame && d->cols == old_cols && d->prev_cursor_row < d->rows) {
+        if (d->rows > old_rows) {
+            memset(d->prev_styles + old_rows*d->cols, STYLE_UNKNOWN, (d->rows - old_rows)*d->cols*sizeof(*d->prev_styles));
         }
+    } else {
+        d->has_prev_frame = false;
     }
 }
 
-void editor_move_word_left(Editor *e)
+void display_resize(Display *d)
 {
-    while (0 < e->cursor && e->cursor < e->data.count && !isalnum(e->data.items[e->cursor])) {
-        e->cursor -= 1;
-    }
-    while (0 < e->cursor && e->cursor < e->data.count && isalnum(e->data.items[e->cursor])) {
-        e->cursor -= 1;
-    }
+    struct winsize w;
+    int err = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    ASSERT(err == 0, "All the necessary checks to make sure this works should've been done beforehand");
+    display_resize_to(d, w.ws_row, w.ws_col);
 }
 
-void editor_move_word_right(Editor *e)
+// Encodes the cells [begin, end) of the row `row` as is. Returns the column where the
+// cursor ends up, which is d->cols if the last run may have left it anywhere.
+size_t display_encode_cells(const Terminal *t, Display *d, size_t row, size_t begin, size_t end, Style *style)
 {
-    while (0 <= e->cursor && e->cursor < e->data.count - 1 && !isalnum(e->data.items[e->cursor])) {
-        e->cursor += 1;
-    }
-    while (0 <= e->cursor && e->cursor < e->data.count - 1 && isalnum(e->data.items[e->cursor])) {
-        e->cursor += 1;
+    size_t col = begin;
+    while (col < end) {
+        size_t i = row*d->cols + col;
+        if (d->styles[i] != *style) {
+            *style = d->styles[i];
+            terminal_encode_style(t, &d->out, *style);
+        }
+        size_t n = 1;
+        while (col + n < end && d->chars[i + n] == d->chars[i] && d->styles[i + n] == *style) n += 1;
+        terminal_encode_run(t, &d->out, d->chars[i], *style, n, col + n == d->cols);
+        col += n;
     }
+    return col;
 }
 
-void editor_move_paragraph_up(Editor *e)
+bool display_cell_changed(const Display *d, size_t i)
 {
-    size_t row = editor_current_line(e);
-    while (row > 0 && (e->lines.items[row].end - e->lines.items[row].begin) == 0) {
-        row -= 1;
-    }
-    while (row > 0 && (e->lines.items[row].end - e->lines.items[row].begin) > 0) {
-        row -= 1;
-    }
-    e->cursor = e->lines.items[row].begin;
+    return d->chars[i] != d->prev_chars[i] || d->styles[i] != d->prev_styles[i];
 }
 
-void editor_move_paragraph_down(Editor *e)
+// Encodes only the cells that changed since the previous frame. For each row it
+// decides whether it's cheaper to skip the unchanged cells between the changes
+// with a cursor move or to just overwrite them, and whether to clear the blank
+// tail of the row with EL instead of writing the spaces.
+void display_encode_diff(const Terminal *t, Display *d, size_t *cursor_row, size_t *cursor_col, Style *style)
 {
-    size_t row = editor_current_line(e);
-    while (row < e->lines.count - 1 && (e->lines.items[row].end - e->lines.items[row].begin) == 0) {
-        row += 1;
+    for (size_t row = 0; row < d->rows; ++row) {
+        size_t base = row*d->cols;
+
+        // The changed cells of the row are within [first, limit)
+        size_t first = 0;
+        while (first < d->cols && !display_cell_changed(d, base + first)) first += 1;
+        if (first >= d->cols) continue;
+        size_t limit = d->cols;
+        while (!display_cell_changed(d, base + limit - 1)) limit -= 1;
+
+        size_t blank = d->ends[row];
+
+        size_t erase_from = d->cols;
+        if (limit > blank) {
+            size_t tail_first = first > blank ? first : blank;
+            while (!display_cell_changed(d, base + tail_first)) tail_first += 1;
+            // EL is 3 bytes, while the spaces cost at least a byte per cell
+            if (limit - tail_first > 3) {
+                erase_from = tail_first;
+                limit = tail_first;
+                while (limit > first && !display_cell_changed(d, base + limit - 1)) limit -= 1;
+            }
+        }
+
+        size_t col = first;
+        while (col < limit) {
+            // Skip the unchanged cells
+            while (!display_cell_changed(d, base + col)) col += 1;
+
+            // Span of cells to write: the changes plus the gaps that are cheaper to overwrite
+            // than to jump over with CUF.
+            size_t end = col + 1;
+            while (end < limit) {
+                size_t gap = 0;
+                bool same_style = true;
+                while (!display_cell_changed(d, base + end + gap)) {
+                    same_style = same_style && d->styles[base + end + gap] == d->styles[base + end - 1];
+                    gap += 1;
+                }
+                size_t move_cost = gap == 1 ? 3 : 3 + count_digits(gap);
+                if (gap > 0 && (!same_style || move_cost < gap)) break;
+                end += gap + 1;
+            }
+
+            terminal_encode_move(&d->out, d->cols, *cursor_row, *cursor_col, row, col);
+            *cursor_row = row;
+            *cursor_col = display_encode_cells(t, d, row, col, end, style);
+            col = end;
+        }
+
+        if (erase_from < d->cols) {
+            terminal_encode_move(&d->out, d->cols, *cursor_row, *cursor_col, row, erase_from);
+            if (*style != STYLE_DEFAULT) {
+                *style = STYLE_DEFAULT;
+                terminal_encode_style(t, &d->out, *style);
+            }
+            data_append_cstr(&d->out, "\033[K");
+            *cursor_row = row;
+            *cursor_col = erase_from;
+        }
     }
-    while (row < e->lines.count - 1 && (e->lines.items[row].end - e->lines.items[row].begin) > 0) {
-        row += 1;
+}
+
+void display_flush(FILE *target, const Terminal *t, Display *d)
+{
+    d->out.count = 0;
+    if (t->sync_output) data_append_cstr(&d->out, "\033[?2026h");
+
+    Style style = STYLE_DEFAULT;
+    size_t cursor_row, cursor_col;
+    bool full = !d->has_prev_frame;
+    if (full) {
+        data_append_cstr(&d->out, "\033[H");
+        for (size_t row = 0; row < d->rows; ++row) {
+            if (row > 0) data_append_cstr(&d->out, "\r\n");
+            display_encode_cells(t, d, row, 0, d->ends[row], &style);
+            if (d->ends[row] < d->cols) {
+                if (style != STYLE_DEFAULT) {
+                    style = STYLE_DEFAULT;
+                    terminal_encode_style(t, &d->out, style);
+                }
+                data_append_cstr(&d->out, "\033[K");
+            }
+        }
+        cursor_row = d->rows - 1;
+        cursor_col = d->ends[d->rows - 1];
+    } else {
+        cursor_row = d->prev_cursor_row;
+        cursor_col = d->prev_cursor_col;
+        display_encode_diff(t, d, &cursor_row, &cursor_col, &style);
     }
-    e->cursor = e->lines.items[row].begin;
+    if (style != STYLE_DEFAULT) terminal_encode_style(t, &d->out, STYLE_DEFAULT);
+
+    terminal_encode_move(&d->out, d->cols, cursor_row, cursor_col, d->cursor_row, d->cursor_col);
+    if (t->sync_output) data_append_cstr(&d->out, "\033[?2026l");
+
+    fwrite(d->out.items, sizeof(*d->out.items), d->out.count, target);
+    fflush(target);
+
+    memcpy(d->prev_chars, d->chars, d->rows*d->cols*sizeof(*d->chars));
+    memcpy(d->prev_styles, d->styles, d->rows*d->cols*sizeof(*d->styles));
+    d->prev_cursor_row = d->cursor_row;
+    d->prev_cursor_col = d->cursor_col;
+    d->has_prev_frame = true;
+
+    profiler.frames += 1;
+    if (full) profiler.full_frames += 1;
+    profiler.bytes_sent += d->out.count;
+    profiler.bytes_raw += d->rows*d->cols;
 }
 
-void editor_move_to_buffer_start(Editor *e)
+void display_free_buffers(Display *d)
 {
-    e->cursor = 0;
+    free(d->chars);
+    free(d->styles);
+    free(d->ends);
+    free(d->prev_chars);
+    free(d->prev_styles);
+    free(d->out.items);
+    d->chars = 0;
+    d->styles = 0;
+    d->ends = 0;
+    d->prev_chars = 0;
+    d->prev_styles = 0;
+    d->out.items = 0;
 }
 
-void editor_move_to_buffer_end(Editor *e)
+// Splits the bytes from the terminal into keys. The special keys come as escape sequences
+// that begin with ESC, which is also what the Escape key sends on its own, and a slow
+// connection may split a sequence between the reads. So an unfinished sequence at the end
+// of the input waits for the rest of it, but not longer than esc_timeout_ns since the last
+// read, and is taken as is after that.
+typedef struct {
+    char items[INPUT_CAPACITY];
+    size_t begin;
+    size_t end;
+    uint64_t esc_timeout_ns;
+    uint64_t deadline; // 0 if nothing is waiting
+    // The terminal sends the Escape key as CSI 27 u, so an ESC always begins a sequence
+    // and the rest of it is waited for up to INPUT_UNAMBIGUOUS_TIMEOUT_NS. The timeout
+    // still matters for a stray ESC at the end of a paste, or for a terminal that
+    // answered the query but ignored the push of the flags.
+    bool unambiguous;
+    // The replies to terminal_probe() that came after its timeout are dropped until DA1,
+    // which is the last of them, but not longer than INPUT_PROBE_TIMEOUT_NS in case the
+    // terminal never answers it
+    uint64_t probe_deadline; // 0 if no replies are expected
+    bool dcs; // Dropping the rest of a DCS reply up to its ST
+} Input;
+
+#define INPUT_UNAMBIGUOUS_TIMEOUT_NS (500ULL*1000*1000)
+#define INPUT_PROBE_TIMEOUT_NS (3000ULL*1000*1000)
+
+// Size of the key at the beginning of the bytes, or 0 if it may continue in the bytes that
+// didn't arrive yet
+size_t input_key_size(const char *bytes, size_t count)
 {
-    e->cursor = e->data.count;
+    if (count == 0) return 0;
+    if (bytes[0] != ES_ESCAPE[0]) return 1;
+    if (count == 1) return 0;
+    if (bytes[1] == '[') {
+        for (size_t i = 2; i < count; ++i) {
+            if (0x40 <= bytes[i] && bytes[i] <= 0x7E) return i + 1;
+            // Not a part of the sequence, so the sequence is broken
+            if (bytes[i] < 0x20 || bytes[i] > 0x3F) return i;
+        }
+        return 0;
+    }
+    if (bytes[1] == 'O') return count >= 3 ? 3 : 0;
+    // ESC ESC is the Escape key followed by something
+    if (bytes[1] == ES_ESCAPE[0]) return 1;
+    // Alt with a key
+    return 2;
 }
 
-void editor_move_to_line_start(Editor *e)
+// Turns the keys sent as CSI code;modifiers u by the terminals with the progressive keyboard
+// enhancement into the legacy bytes that the key handlers expect. Returns the new size of
+// the key, which is left as is if it has no legacy encoding.
+size_t input_translate_csi_u(char *seq, size_t seq_len)
 {
-    size_t row = editor_current_line(e);
-    e->cursor = e->lines.items[row].begin;
+    if (seq_len < 4 || seq[0] != ES_ESCAPE[0] || seq[1] != '[' || seq[seq_len - 1] != 'u') return seq_len;
+
+    unsigned code = 0;
+    unsigned modifiers = 1;
+    size_t i = 2;
+    for (; i < seq_len - 1 && isdigit(seq[i]); ++i) code = code*10 + seq[i] - '0';
+    if (i == 2 || code > 127) return seq_len;
+    if (seq[i] == ';') {
+        modifiers = 0;
+        for (i += 1; i < seq_len - 1 && isdigit(seq[i]); ++i) modifiers = modifiers*10 + seq[i] - '0';
+    }
+    if (i != seq_len - 1 || modifiers == 0) return seq_len;
+
+    // The bits are shift, alt, ctrl, super and so on. The lock keys don't matter.
+    unsigned bits = (modifiers - 1) & ~(64u | 128u);
+    if (bits & ~7u) return seq_len;
+
+    char x = code;
+    if (bits & 4) {
+        if ('a' <= x && x <= 'z') x = x - 'a' + 'A';
+        if (x <= '@' || x > '_') return seq_len;
+        x &= 0x1F;
+    }
+    size_t n = 0;
+    if (bits & 2) seq[n++] = ES_ESCAPE[0];
+    seq[n++] = x;
+    seq[n] = '\0';
+    return n;
 }
 
-void editor_move_to_line_end(Editor *e)
+// Whether the unfinished sequence at the beginning of the input still waits for the rest of it
+bool input_waiting(Input *in, uint64_t now)
 {
-    size_t row = editor_current_line(e);
-    e->cursor = e->lines.items[row].end;
+    if (in->deadline == 0) {
+        uint64_t timeout = in->esc_timeout_ns;
+        if (in->unambiguous && timeout < INPUT_UNAMBIGUOUS_TIMEOUT_NS) timeout = INPUT_UNAMBIGUOUS_TIMEOUT_NS;
+        in->deadline = now + timeout;
+    }
+    return now < in->deadline;
 }
 
-void display_resize(Display *d)
+bool input_append(Input *in, const char *bytes, size_t count)
 {
-    struct winsize w;
-    int err = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    ASSERT(err == 0, "All the necessary checks to make sure this works should've been done beforehand");
-    d->rows = w.ws_row;
-    d->cols = w.ws_col;
-    d->chars = realloc(d->chars, d->rows*d->cols*sizeof(*d->chars));
-    ASSERT(d->chars != NULL, "Buy more RAM lol");
+    if (in->begin > 0) {
+        memmove(in->items, in->items + in->begin, in->end - in->begin);
+        in->end -= in->begin;
+        in->begin = 0;
+    }
+    if (count > sizeof(in->items) - in->end) return false;
+    memcpy(in->items + in->end, bytes, count);
+    in->end += count;
+    // Every read gives the unfinished sequence another esc_timeout_ns
+    in->deadline = 0;
+    return true;
 }
 
-void display_flush(FILE *target, Display *d)
+// Takes the next key out of the input into `seq` as a NULL-terminated string. `now` is
+// needed to tell the Escape key from the beginning of the sequence that got split.
+bool input_next_key(Input *in, char seq[MAX_ESC_SEQ_LEN], size_t *seq_len, uint64_t now)
 {
-    // TODO: efficient rerendering with patching and stuff
-    // Might not be needed since the current method is already fast enough
-    // to prevent flickering
-    fprintf(target, "\033[H");
-    fwrite(d->chars, sizeof(*d->chars), d->rows*d->cols, target);
-    fprintf(target, "\033[%zu;%zuH", d->cursor_row + 1, d->cursor_col + 1);
-    fflush(target);
+    for (;;) {
+        size_t count = in->end - in->begin;
+        if (count == 0) return false;
+        const char *key = in->items + in->begin;
+        bool probing = now < in->probe_deadline;
+        if (in->dcs && !probing) {
+            // The rest of it goes as the keys
+            in->dcs = false;
+        } else if (in->dcs) {
+            // The reply may be split between the reads, and so may be its ST
+            const char *st = memmem(key, count, "\033\\", 2);
+            if (st == NULL) {
+                in->begin = in->end - (key[count - 1] == ES_ESCAPE[0]);
+                return false;
+            }
+            in->begin = st + 2 - in->items;
+            in->dcs = false;
+            continue;
+        }
+
+        size_t size = input_key_size(key, count);
+        // DCS replies look like Alt+P followed by the keys: ESC P >| for XTVERSION and
+        // ESC P 1 + r for XTGETTCAP
+        if (probing && size == 2 && key[1] == 'P') {
+            if (count < 4 && input_waiting(in, now)) return false;
+            if (count >= 4 && ((key[2] == '>' && key[3] == '|') || ((key[2] == '0' || key[2] == '1') && key[3] == '+'))) {
+                in->deadline = 0;
+                in->begin += 2;
+                in->dcs = true;
+                continue;
+            }
+        }
+        if (size == 0) {
+            if (count < MAX_ESC_SEQ_LEN && input_waiting(in, now)) return false;
+            size = count;
+        }
+        in->deadline = 0;
+
+        in->begin += size;
+        // The keys never have the private markers, unlike the CSI replies
+        if (probing && size >= 3 && key[0] == ES_ESCAPE[0] && key[1] == '[' && (key[2] == '?' || key[2] == '>')) {
+            if (key[2] == '?' && key[size - 1] == 'c') in->probe_deadline = 0;
+            continue;
+        }
+        if (size >= MAX_ESC_SEQ_LEN) {
+            // Escape sequence is too big. Ignoring it.
+            continue;
+        }
+        memcpy(seq, key, size);
+        seq[size] = '\0';
+        *seq_len = input_translate_csi_u(seq, size);
+        return true;
+    }
 }
 
-void display_free_buffers(Display *d)
+// Timeout for poll(2) until the waiting sequence is taken as is
+int input_timeout_ms(const Input *in, uint64_t now)
 {
-    free(d->chars);
-    d->chars = 0;
+    if (in->deadline == 0) return -1;
+    return now < in->deadline ? (in->deadline - now + 999999)/1000000 : 0;
 }
 
-int editor_start_interactive(Editor *e, const char *file_path)
+int editor_start_interactive(Workspace *ws)
 {
     int result = 0;
 
     Display d = {0};
+    Terminal t = {0};
     bool terminal_prepared = false;
     bool signals_prepared = false;
 
@@ -490,8 +6650,21 @@ int editor_start_interactive(Editor *e, const char *file_path)
 
     terminal_prepared = true;
 
-    struct sigaction act, old = {0};
+    terminal_probe(&t);
+
+    if (pipe(resize_pipe) < 0) {
+        fprintf(stderr, "ERROR: could not create the pipe for the window resize signal: %s\n", strerror(errno));
+        return_defer(1);
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        fcntl(resize_pipe[i], F_SETFL, fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction act = {0}, old = {0};
     act.sa_handler = window_resize_signal;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
     if (sigaction(SIGWINCH, &act, &old) < 0) {
         fprintf(stderr, "ERROR: could not set up window resize signal: %s\n", strerror(errno));
         return_defer(1);
@@ -499,85 +6672,139 @@ int editor_start_interactive(Editor *e, const char *file_path)
 
     signals_prepared = true;
 
-    bool quit = false;
-    bool insert = false;
+    // Switching to the alternate screen, which does not have the scrollback. So growing the
+    // window does not pull the old lines into the top of the screen and we can keep our idea
+    // of what is on the screen across the resizes.
+    printf("\033[?1049h");
+    // Only disambiguating the escape codes. The stack of the flags is per screen, so this
+    // happens on the alternate one.
+    if (t.csi_u) printf("\033[>1u");
+
+    // Dragging the window produces a storm of SIGWINCHs. We apply the new size only when
+    // they stop coming for RESIZE_DEBOUNCE_NS and don't render anything in between.
+    bool resize_pending = false;
+    uint64_t resize_deadline = 0;
+    // When the current buffer was last edited, see BACKGROUND_DEBOUNCE_NS
+    const Editor *edited = NULL;
+    size_t edited_generation = 0;
+    uint64_t edited_ns = 0;
+    Input input = {
+        .esc_timeout_ns = (uint64_t) ws->esc_timeout_ms*1000*1000,
+        .unambiguous = t.csi_u,
+        .probe_deadline = t.late_replies ? now_ns() + INPUT_PROBE_TIMEOUT_NS : 0,
+    };
     display_resize(&d);
-    while (!quit) {
-        editor_rerender(e, insert, &d);
-        display_flush(stdout, &d);
-
-        char seq[MAX_ESC_SEQ_LEN] = {0};
-        errno = 0;
-        int seq_len = read(STDIN_FILENO, seq, sizeof(seq));
-        if (errno == EINTR) {
-            // Window got resized. Since SIGWINCH is the only signal that we
-            // handle right now, there is no need to check if EINTR is caused
-            // specifically by SIGWINCH. In the future it may change. But even
-            // in the future I feel like just doing continue on EINTR regardless
-            // of the signal is sufficient.
-            display_resize(&d);
-            continue;
+    while (!ws->quit) {
+        Editor *e = ws->buffers.items[ws->buffers.current];
+        editor_load_pending(e);
+        if (e != edited) {
+            // Switching to a buffer is not an edit
+            edited = e;
+            edited_generation = e->generation;
+            edited_ns = 0;
+        } else if (e->generation != edited_generation) {
+            edited_generation = e->generation;
+            edited_ns = now_ns();
+        }
+        uint64_t background_deadline = e->data.count < BACKGROUND_DEBOUNCE_SIZE ? 0 : edited_ns + BACKGROUND_DEBOUNCE_NS;
+        bool background_ready = now_ns() >= background_deadline;
+        bool background_waiting = false;
+        if (editor_json_stale(e) && !ws->json_build.running) {
+            if (background_ready) {
+                json_build_start(&ws->json_build, e);
+            } else {
+                background_waiting = true;
+            }
+        }
+        if (editor_git_stale(e) && !ws->git_job.running) {
+            if (background_ready) {
+                git_job_start(&ws->git_job, e);
+            } else {
+                background_waiting = true;
+            }
         }
-        if (errno > 0) {
-            fprintf(stderr, "ERROR: something went wrong during reading of the user input: %s\n", strerror(errno));
+        if (e->scratch && strcmp(e->file_path, DIFF_RESULTS_PATH) == 0) workspace_diff_refresh(ws, false);
+        if (!resize_pending) {
+            editor_rerender(e, ws->insert, &d);
+            if (e->prompt.kind == PROMPT_FIND_FILE) display_render_finder(&d, ws);
+            display_flush(stdout, &t, &d);
+        }
+
+        struct pollfd fds[7] = {
+            { .fd = STDIN_FILENO,   .events = POLLIN },
+            { .fd = resize_pipe[0], .events = POLLIN },
+            // poll() ignores the negative descriptors
+            { .fd = ws->grep.threads_count > 0 ? ws->grep.notify[0] : -1, .events = POLLIN },
+            { .fd = ws->files_walk.threads_count > 0 ? ws->files_walk.notify[0] : -1, .events = POLLIN },
+            { .fd = ws->inotify, .events = POLLIN },
+            { .fd = ws->json_build.running ? ws->json_build.notify[0] : -1, .events = POLLIN },
+            { .fd = ws->git_job.running ? ws->git_job.notify[0] : -1, .events = POLLIN },
+        };
+        uint64_t now = now_ns();
+        int timeout = input_timeout_ms(&input, now);
+        if (resize_pending) {
+            int resize_timeout = now < resize_deadline ? (resize_deadline - now + 999999)/1000000 : 0;
+            if (timeout < 0 || resize_timeout < timeout) timeout = resize_timeout;
+        }
+        if (background_waiting) {
+            int background_timeout = now < background_deadline ? (background_deadline - now + 999999)/1000000 : 0;
+            if (timeout < 0 || background_timeout < timeout) timeout = background_timeout;
+        }
+        int ret = poll(fds, sizeof(fds)/sizeof(fds[0]), timeout);
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "ERROR: something went wrong during waiting for the user input: %s\n", strerror(errno));
             return_defer(1);
         }
 
-        ASSERT(seq_len >= 0, "If there is no error, seq_len cannot be less than 0");
-        if ((size_t) seq_len >= sizeof(seq)) {
-            // Escape sequence is too big. Ignoring it.
-            continue;
+        // SIGWINCH interrupts poll() before it sees the byte in the pipe
+        if (ret < 0 || (fds[1].revents & POLLIN)) {
+            char drain[64];
+            ssize_t n;
+            size_t signals = 0;
+            while ((n = read(resize_pipe[0], drain, sizeof(drain))) > 0) signals += n;
+            if (signals > 0) {
+                profiler.resize_signals += signals;
+                resize_pending = true;
+                resize_deadline = now_ns() + RESIZE_DEBOUNCE_NS;
+            }
         }
 
-        if (insert) {
-            if (strcmp(seq, "\x1b ") == 0 || strcmp(seq, ES_ESCAPE) == 0) {
-                insert = false;
-                editor_save_to_file(e, file_path);
-            } else if (strcmp(seq, ES_BACKSPACE) == 0) {
-                editor_backdelete_char(e);
-            } else if (strcmp(seq, ES_DELETE) == 0) {
-                editor_delete_char(e);
-            } else if (strcmp(seq, "\n") == 0) {
-                editor_insert_char(e, '\n');
-            } else if (seq_len == 1 && is_display(seq[0])) {
-                editor_insert_char(e, seq[0]);
+        if (resize_pending && now_ns() >= resize_deadline) {
+            resize_pending = false;
+            display_resize(&d);
+            profiler.resizes += 1;
+        }
+
+        if (fds[2].revents & POLLIN) workspace_grep_poll(ws);
+        if (fds[3].revents & POLLIN) workspace_files_poll(ws);
+        if (fds[4].revents & POLLIN) workspace_inotify_poll(ws);
+        if (fds[5].revents & POLLIN) json_build_finish(&ws->json_build);
+        if (fds[6].revents & POLLIN) git_job_finish(&ws->git_job);
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char bytes[INPUT_CAPACITY - MAX_ESC_SEQ_LEN];
+            ssize_t n = read(STDIN_FILENO, bytes, sizeof(bytes));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "ERROR: something went wrong during reading of the user input: %s\n", strerror(errno));
+                return_defer(1);
             }
-        } else {
-            if (strcmp(seq, "q") == 0) {
-                quit = true;
-            } else if (strcmp(seq, ES_ESCAPE" ") == 0 || strcmp(seq, " ") == 0) {
-                insert = true;
-            } else if (strcmp(seq, "s") == 0) {
-                editor_move_line_up(e);
-            } else if (strcmp(seq, "w") == 0) {
-                editor_move_line_down(e);
-            } else if (strcmp(seq, "a") == 0) {
-                editor_move_char_left(e);
-            } else if (strcmp(seq, "d") == 0) {
-                editor_move_char_right(e);
-            } else if (strcmp(seq, "k") == 0) {
-                editor_move_word_left(e);
-            } else if (strcmp(seq, ";") == 0) {
-                editor_move_word_right(e);
-            } else if (strcmp(seq, "o") == 0) {
-                editor_move_paragraph_up(e);
-            } else if (strcmp(seq, "l") == 0) {
-                editor_move_paragraph_down(e);
-            } else if (strcmp(seq, "O") == 0) {
-                editor_move_to_buffer_start(e);
-            } else if (strcmp(seq, "L") == 0) {
-                editor_move_to_buffer_end(e);
-            } else if (strcmp(seq, "K") == 0) {
-                editor_move_to_line_start(e);
-            } else if (strcmp(seq, ":") == 0) {
-                editor_move_to_line_end(e);
-            } else if (strcmp(seq, ES_DELETE) == 0) {
-                editor_delete_char(e);
-            } else if (strcmp(seq, ES_BACKSPACE) == 0) {
-                editor_backdelete_char(e);
-            } else if (strcmp(seq, "\n") == 0) {
-                editor_insert_char(e, '\n');
+            if (n == 0) {
+                // The terminal is gone
+                ws->quit = true;
+                continue;
             }
+            // The bytes of an unfinished sequence are never more than MAX_ESC_SEQ_LEN, so they fit
+            bool appended = input_append(&input, bytes, n);
+            ASSERT(appended, "The input must have enough space for a read");
+        }
+
+        // All the keys that arrived are handled before rendering anything
+        char seq[MAX_ESC_SEQ_LEN];
+        size_t seq_len;
+        while (!ws->quit && input_next_key(&input, seq, &seq_len, now_ns())) {
+            workspace_handle_key(ws, seq, seq_len);
+            if (ws->replay_pending) workspace_replay_macro(ws);
         }
     }
 
@@ -586,8 +6813,17 @@ defer:
         UNUSED(sigaction(SIGWINCH, &old, NULL));
     }
 
+    for (size_t i = 0; i < 2; ++i) {
+        if (resize_pipe[i] >= 0) {
+            close(resize_pipe[i]);
+            resize_pipe[i] = -1;
+        }
+    }
+
     if (terminal_prepared) {
-        printf("\033[2J\033[H");
+        if (t.csi_u) printf("\033[<u");
+        printf("\033[0m\033[2J\033[H\033[?1049l");
+        fflush(stdout);
         term.c_lflag |= ECHO;
         term.c_lflag |= ICANON;
         UNUSED(tcsetattr(STDIN_FILENO, 0, &term));
@@ -598,6 +6834,133 @@ defer:
     return result;
 }
 
+// Written by src/escape.c -o
+#define INPUT_RECORD_MAGIC "NOEDINP1"
+
+typedef struct {
+    uint64_t time_ns; // Since the beginning of the recording
+    uint64_t size;    // Followed by that many bytes of the chunk
+} Input_Chunk;
+
+#define REPLAY_INPUT_ROWS 24
+#define REPLAY_INPUT_COLS 80
+
+typedef struct {
+    uint64_t *items;
+    size_t count;
+    size_t capacity;
+} Latencies;
+
+int compare_latencies(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void replay_input_keys(Workspace *ws, Input *input, uint64_t now, Display *d, const Terminal *t, FILE *out, Latencies *latencies)
+{
+    char seq[MAX_ESC_SEQ_LEN];
+    size_t seq_len;
+    while (!ws->quit && input_next_key(input, seq, &seq_len, now)) {
+        uint64_t begin = now_ns();
+        workspace_handle_key(ws, seq, seq_len);
+        if (ws->replay_pending) workspace_replay_macro(ws);
+        Editor *e = ws->buffers.items[ws->buffers.current];
+        editor_load_pending(e);
+        editor_rerender(e, ws->insert, d);
+        if (e->prompt.kind == PROMPT_FIND_FILE) display_render_finder(d, ws);
+        display_flush(out, t, d);
+        da_append(latencies, now_ns() - begin);
+    }
+}
+
+// Feeds the input recorded by src/escape.c to the editor as fast as possible through the
+// same Input as the interactive mode, and renders every key into /dev/null. Nothing is
+// saved. Reports how long the keys took to handle and render.
+int editor_replay_input(Workspace *ws, const char *file_path)
+{
+    int result = 0;
+    Display d = {0};
+    Terminal t = {0};
+    Latencies latencies = {0};
+    FILE *f = NULL;
+    FILE *out = NULL;
+
+    f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return_defer(1);
+    }
+    char magic[sizeof(INPUT_RECORD_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, INPUT_RECORD_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not an input recording of src/escape.c\n", file_path);
+        return_defer(1);
+    }
+    out = fopen("/dev/null", "wb");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: could not open /dev/null: %s\n", strerror(errno));
+        return_defer(1);
+    }
+
+    ws->dry_run = true;
+    display_resize_to(&d, REPLAY_INPUT_ROWS, REPLAY_INPUT_COLS);
+
+    size_t dropped = 0;
+    uint64_t recorded_ns = 0;
+    uint64_t begin = now_ns();
+    // The recorded time decides if an unfinished sequence waited long enough
+    Input input = { .esc_timeout_ns = (uint64_t) ws->esc_timeout_ms*1000*1000 };
+    Input_Chunk chunk;
+    while (!ws->quit) {
+        char bytes[INPUT_CAPACITY];
+        bool more = fread(&chunk, sizeof(chunk), 1, f) == 1;
+        if (more) {
+            if (chunk.size > sizeof(bytes)) {
+                if (fseek(f, chunk.size, SEEK_CUR) < 0) break;
+                dropped += 1;
+                continue;
+            }
+            if (chunk.size > 0 && fread(bytes, chunk.size, 1, f) != 1) break;
+            recorded_ns = chunk.time_ns;
+        }
+
+        // The waiting sequence may time out before the chunk arrives. The end of the recording
+        // lets everything that is left time out.
+        replay_input_keys(ws, &input, more ? chunk.time_ns : UINT64_MAX, &d, &t, out, &latencies);
+        if (!more) break;
+        if (!input_append(&input, bytes, chunk.size)) {
+            dropped += 1;
+            continue;
+        }
+        replay_input_keys(ws, &input, chunk.time_ns, &d, &t, out, &latencies);
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: could not read file %s: %s\n", file_path, strerror(errno));
+        return_defer(1);
+    }
+    uint64_t elapsed = now_ns() - begin;
+
+    printf("Keys:      %zu (%zu reads dropped)\n", latencies.count, dropped);
+    printf("Recorded:  %.3fms\n", recorded_ns/1e6);
+    printf("Replayed:  %.3fms\n", elapsed/1e6);
+    if (latencies.count > 0) {
+        qsort(latencies.items, latencies.count, sizeof(*latencies.items), compare_latencies);
+        printf("Latency:   median %.3fms, p99 %.3fms, max %.3fms\n",
+               latencies.items[latencies.count/2]/1e6,
+               latencies.items[latencies.count*99/100]/1e6,
+               latencies.items[latencies.count - 1]/1e6);
+    }
+    fflush(stdout);
+
+defer:
+    if (f) fclose(f);
+    if (out) fclose(out);
+    free(latencies.items);
+    display_free_buffers(&d);
+    return result;
+}
+
 char *shift_args(int *argc, char ***argv)
 {
     ASSERT(*argc > 0, "Ran out of arguments to shift");
@@ -621,19 +6984,34 @@ bool decimal_string_as_uint64_with_overflow(const char *str, uint64_t *result)
 
 void usage(const char *program)
 {
-    fprintf(stderr, "Usage: %s [OPTIONS] <input.txt>\n", program);
+    fprintf(stderr, "Usage: %s [OPTIONS] [input.txt]\n", program);
     fprintf(stderr, "OPTIONS:\n");
     fprintf(stderr, "    -gt <line-number>    go to the provided <line-number>\n");
+    fprintf(stderr, "    -tw <width>          set the distance between the tab stops (default: %d)\n", DEFAULT_TAB_WIDTH);
+    fprintf(stderr, "    -tf <format>         strptime(3) format of the timestamps at the beginning of the lines\n");
+    fprintf(stderr, "                         (default: %s)\n", DEFAULT_TIME_FORMAT);
+    fprintf(stderr, "    -session <file>      restore the open files from <file> and save them there on exit\n");
+    fprintf(stderr, "    -esc-timeout <ms>    how long ESC waits for the rest of an escape sequence (default: %d)\n", DEFAULT_ESC_TIMEOUT_MS);
+    fprintf(stderr, "    -profile             print the rendering statistics on exit\n");
+    fprintf(stderr, "    -replay <file>       replay the input recorded by escape -o instead of reading the terminal,\n");
+    fprintf(stderr, "                         without saving anything, and print the latencies of the keys\n");
 }
 
 int main(int argc, char **argv)
 {
     int result = 0;
-    Editor editor = {0};
+    Workspace ws = { .inotify = -1 };
 
     const char *program = shift_args(&argc, &argv);
     const char *file_path = NULL;
+    const char *session_path = NULL;
+    const char *replay_path = NULL;
+    bool has_goto_line = false;
     uint64_t goto_line = 0;
+    uint64_t tab_width = DEFAULT_TAB_WIDTH;
+    uint64_t esc_timeout = DEFAULT_ESC_TIMEOUT_MS;
+    bool profile = false;
+    const char *time_format = DEFAULT_TIME_FORMAT;
 
     while (argc > 0) {
         const char *flag = shift_args(&argc, &argv);
@@ -649,6 +7027,54 @@ int main(int argc, char **argv)
                 fprintf(stderr, "ERROR: the value of %s is expected to be a non-negative integer\n", flag);
                 return_defer(1);
             }
+            has_goto_line = true;
+        } else if (strcmp(flag, "-tf") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                fprintf(stderr, "ERROR: no value is provided for the flag %s\n", flag);
+                return_defer(1);
+            }
+            time_format = shift_args(&argc, &argv);
+        } else if (strcmp(flag, "-session") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                fprintf(stderr, "ERROR: no value is provided for the flag %s\n", flag);
+                return_defer(1);
+            }
+            session_path = shift_args(&argc, &argv);
+        } else if (strcmp(flag, "-replay") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                fprintf(stderr, "ERROR: no value is provided for the flag %s\n", flag);
+                return_defer(1);
+            }
+            replay_path = shift_args(&argc, &argv);
+        } else if (strcmp(flag, "-esc-timeout") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                fprintf(stderr, "ERROR: no value is provided for the flag %s\n", flag);
+                return_defer(1);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if (!decimal_string_as_uint64_with_overflow(value, &esc_timeout) || esc_timeout > 10*1000) {
+                usage(program);
+                fprintf(stderr, "ERROR: the value of %s is expected to be an integer from 0 to 10000\n", flag);
+                return_defer(1);
+            }
+        } else if (strcmp(flag, "-profile") == 0) {
+            profile = true;
+        } else if (strcmp(flag, "-tw") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                fprintf(stderr, "ERROR: no value is provided for the flag %s\n", flag);
+                return_defer(1);
+            }
+            const char *value = shift_args(&argc, &argv);
+            if (!decimal_string_as_uint64_with_overflow(value, &tab_width) || tab_width == 0) {
+                usage(program);
+                fprintf(stderr, "ERROR: the value of %s is expected to be a positive integer\n", flag);
+                return_defer(1);
+            }
         } else {
             if (file_path != NULL) {
                 usage(program);
@@ -660,22 +7086,48 @@ int main(int argc, char **argv)
         }
     }
 
-    if (file_path == NULL) {
+    ws.tab_width = tab_width;
+    ws.time_format = time_format;
+    ws.esc_timeout_ms = esc_timeout;
+    if (session_path != NULL && !workspace_restore_session(&ws, session_path)) return_defer(1);
+
+    if (file_path == NULL && ws.buffers.count == 0) {
         usage(program);
         fprintf(stderr, "ERROR: no input file is provided\n");
         return_defer(1);
     }
 
-    if (!editor_open_file(&editor, file_path)) return_defer(1);
-    if (goto_line >= editor.lines.count) {
-        goto_line = editor.lines.count - 1;
+    if (file_path != NULL) {
+        size_t buffers_count = ws.buffers.count;
+        if (!workspace_open_file(&ws, file_path, false)) {
+            // With the buffers of the session the error went to the current one
+            if (ws.buffers.count > 0) {
+                Editor *current = ws.buffers.items[ws.buffers.current];
+                fprintf(stderr, "ERROR: %.*s\n", (int) current->status.count, current->status.items);
+            }
+            return_defer(1);
+        }
+        Editor *editor = ws.buffers.items[ws.buffers.current];
+        // Files restored from the session keep their cursor
+        if (has_goto_line || ws.buffers.count > buffers_count) {
+            if (goto_line >= editor->lines.count) {
+                goto_line = editor->lines.count - 1;
+            }
+            editor->cursor = editor->lines.items[goto_line].begin;
+        }
+    }
+    if (replay_path != NULL) {
+        int exit_code = editor_replay_input(&ws, replay_path);
+        if (profile) profiler_report(stderr);
+        return_defer(exit_code);
     }
-    editor.cursor = editor.lines.items[goto_line].begin;
-    int exit_code = editor_start_interactive(&editor, file_path);
+    int exit_code = editor_start_interactive(&ws);
+    if (session_path != NULL && !workspace_save_session(&ws, session_path) && exit_code == 0) exit_code = 1;
+    if (profile) profiler_report(stderr);
     return_defer(exit_code);
 
 defer:
-    editor_free_buffers(&editor);
+    workspace_free(&ws);
     return result;
 }
 